@@ -0,0 +1,134 @@
+#define _USE_MATH_DEFINES
+#include <cmath>
+#include <random>
+#include <limits>
+#include <chrono>
+#include <vector>
+#include <iostream>
+#include <iomanip>
+
+#include "tinyraytracer.hh"
+#include "model.hh"
+
+// size of the fixed ray set every kernel runs over
+#define BENCH_RAYS (1 << 14)
+// each kernel is repeated over the ray set for at least this long
+#define BENCH_SECONDS 0.25
+
+struct Ray
+{
+    Vec3f orig, dir;
+};
+
+static volatile float sink; // keeps the compiler from dropping the kernels' results
+
+// runs kernel(ray) over the whole ray set until BENCH_SECONDS elapsed and reports ns/op and rays/s
+template <typename Kernel>
+static void run(const char *name, const std::vector<Ray> &rays, Kernel kernel)
+{
+    float acc = 0;
+    size_t ops = 0;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    std::chrono::duration<double> elapsed(0);
+    while (elapsed.count() < BENCH_SECONDS)
+    {
+        for (size_t i = 0; i < rays.size(); i++)
+            acc += kernel(rays[i]);
+        ops += rays.size();
+        elapsed = std::chrono::steady_clock::now() - start;
+    }
+    sink = acc;
+    std::cout << std::left << std::setw(24) << name << std::right << std::setw(10) << std::fixed << std::setprecision(2)
+              << elapsed.count() * 1e9 / ops << " ns/op" << std::setw(12) << ops / elapsed.count() * 1e-6 << " Mrays/s"
+              << std::endl;
+}
+
+// Building blocks of Tinyraytracer::cast_ray, reached as a friend
+struct Bench
+{
+    static void kernels(Tinyraytracer &tinyraytracer, const std::vector<Ray> &rays)
+    {
+        tinyraytracer.setup_frame(0, 0, 15, -0.5, 4);
+
+        run("logo quad", rays, [&](const Ray &r) {
+            float dist = std::numeric_limits<float>::max();
+            Vec3f hit;
+            Vec4f texel;
+            unsigned quad;
+            size_t tests = 0;
+            return tinyraytracer.quads.intersect(r.orig, r.dir, dist, quad, hit, texel, tests) ? dist : 0.f;
+        });
+        run("envmap lookup", rays, [&](const Ray &r) {
+            return tinyraytracer.envmap_lookup(r.dir).x;
+        });
+        run("pixel packing", rays, [&](const Ray &r) {
+            unsigned char pixel[4];
+            Tinyraytracer::store_pixel(pixel, r.dir * 1.5);
+            return float(pixel[0] + pixel[1] + pixel[2]);
+        });
+        run("cast_ray", rays, [&](const Ray &r) {
+            return tinyraytracer.cast_ray(Vec3f(0, 0, 0), r.dir).x;
+        });
+    }
+};
+
+int main()
+{
+    std::mt19937 rng(2022);
+    std::uniform_real_distribution<float> uniform(-1.f, 1.f);
+
+    // origins around the camera, directions uniformly spread on the sphere
+    std::vector<Ray> rays(BENCH_RAYS);
+    for (size_t i = 0; i < rays.size(); i++)
+    {
+        rays[i].orig = Vec3f(uniform(rng), uniform(rng), uniform(rng));
+        do
+            rays[i].dir = Vec3f(uniform(rng), uniform(rng), uniform(rng));
+        while (rays[i].dir * rays[i].dir > 1 || rays[i].dir * rays[i].dir < 1e-4);
+        rays[i].dir.normalize();
+    }
+
+    Material ivory(1.0, Vec4f(0.6, 0.3, 0.1, 0.0), Vec3f(0.4, 0.4, 0.3), 50.);
+    Sphere sphere(Vec3f(0, 0, -16), 8, ivory);
+    run("Sphere::ray_intersect", rays, [&](const Ray &r) {
+        float t;
+        return sphere.ray_intersect(r.orig, r.dir, t) ? t : 0.f;
+    });
+
+    // a triangle facing the camera, large enough to be hit by a fair share of the rays
+    std::vector<Vec3f> verts;
+    verts.push_back(Vec3f(-8, -8, -10));
+    verts.push_back(Vec3f(8, -8, -10));
+    verts.push_back(Vec3f(0, 8, -10));
+    Model triangle(verts, std::vector<Vec3i>(1, Vec3i(0, 1, 2)));
+    run("ray_triangle_intersect", rays, [&](const Ray &r) {
+        float t;
+        Vec3f N;
+        return triangle.ray_triangle_intersect(0, r.orig, r.dir, t, N) ? t : 0.f;
+    });
+
+    Vec3f N(0, 1, 0);
+    run("reflect", rays, [&](const Ray &r) {
+        return reflect(r.dir, N).y;
+    });
+    run("refract", rays, [&](const Ray &r) {
+        return refract(r.dir, N, 1.5).y;
+    });
+
+    // synthetic textures, the benchmark must not depend on the image files
+    std::vector<unsigned char> pixels(4 * 1024 * 512);
+    for (size_t i = 0; i < pixels.size(); i++)
+        pixels[i] = (unsigned char)rng();
+    sf::Image envmap, logo;
+    envmap.create(1024, 512, pixels.data());
+    logo.create(512, 512, pixels.data());
+    Tinyraytracer tinyraytracer(512, 384, envmap, logo, Vec3f(-4, 2, -10));
+    tinyraytracer.add_sphere(Sphere(Vec3f(-3, 0, -16), 2, ivory));
+    tinyraytracer.add_sphere(Sphere(Vec3f(1.5, -0.5, -18), 3, ivory));
+    tinyraytracer.add_sphere(Sphere(Vec3f(7, 5, -18), 4, ivory));
+    tinyraytracer.add_light(Light(Vec3f(-20, 20, 20), 1.5));
+    tinyraytracer.add_light(Light(Vec3f(30, 50, -25), 1.8));
+    tinyraytracer.add_light(Light(Vec3f(30, 20, 30), 1.7));
+    Bench::kernels(tinyraytracer, rays);
+    return 0;
+}
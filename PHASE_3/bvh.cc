@@ -0,0 +1,441 @@
+#include <cstring>
+#include <chrono>
+#include <limits>
+#include <atomic>
+#include <omp.h>
+
+#include "bvh.hh"
+
+static const char *method_names[] = {"median", "sah", "lbvh"};
+
+bool parse_bvh_method(const char *name, BvhMethod &method)
+{
+    for (int m = BVH_MEDIAN; m <= BVH_LBVH; m++)
+        if (!strcmp(name, method_names[m]))
+        {
+            method = BvhMethod(m);
+            return true;
+        }
+    return false;
+}
+
+const char *bvh_method_name(BvhMethod method)
+{
+    return method_names[method];
+}
+
+static float area(const Vec3f &min, const Vec3f &max)
+{
+    Vec3f d = max - min;
+    return 2 * (d.x * d.y + d.y * d.z + d.z * d.x);
+}
+
+// items whose centers fall in one slice of the node along an axis
+struct Bin {
+    Vec3f min, max;
+    unsigned count;
+    Bin() : min(1e30, 1e30, 1e30), max(-1e30, -1e30, -1e30), count(0) {}
+    void add(const Vec3f &lo, const Vec3f &hi)
+    {
+        for (size_t k = 0; k < 3; k++)
+        {
+            min[k] = std::min(min[k], lo[k]);
+            max[k] = std::max(max[k], hi[k]);
+        }
+        count++;
+    }
+    void add(const Bin &bin)
+    {
+        for (size_t k = 0; k < 3; k++)
+        {
+            min[k] = std::min(min[k], bin.min[k]);
+            max[k] = std::max(max[k], bin.max[k]);
+        }
+        count += bin.count;
+    }
+};
+
+struct Bins {
+    Bin bin[3][BVH_BINS];
+};
+
+// 10 bits spread to every third bit
+static unsigned expand_bits(unsigned v)
+{
+    v = (v * 0x00010001u) & 0xFF0000FFu;
+    v = (v * 0x00000101u) & 0x0F00F00Fu;
+    v = (v * 0x00000011u) & 0xC30C30C3u;
+    v = (v * 0x00000005u) & 0x49249249u;
+    return v;
+}
+
+// Stable least significant digit radix sort of 30 bit keys, values moving along.
+// Every thread counts and then moves the digits of its share of the keys.
+static void radix_sort(std::vector<unsigned> &keys, std::vector<unsigned> &values, unsigned threads)
+{
+    const size_t n = keys.size(), digits = 1024;
+    std::vector<unsigned> sorted_keys(n), sorted_values(n);
+    std::vector<size_t> counts(threads * digits);
+    for (unsigned shift = 0; shift < 30; shift += 10)
+    {
+#pragma omp parallel num_threads(threads) if (threads > 1)
+        {
+            size_t t = omp_get_thread_num(), nt = omp_get_num_threads();
+            size_t begin = n * t / nt, end = n * (t + 1) / nt;
+            size_t *count = &counts[t * digits];
+            std::fill(count, count + digits, 0);
+            for (size_t i = begin; i < end; i++)
+                count[(keys[i] >> shift) & (digits - 1)]++;
+#pragma omp barrier
+#pragma omp single
+            {
+                // where every thread writes every digit: by digit, then by thread
+                size_t sum = 0;
+                for (size_t d = 0; d < digits; d++)
+                    for (size_t u = 0; u < nt; u++)
+                    {
+                        size_t c = counts[u * digits + d];
+                        counts[u * digits + d] = sum;
+                        sum += c;
+                    }
+            }
+            for (size_t i = begin; i < end; i++)
+            {
+                size_t slot = count[(keys[i] >> shift) & (digits - 1)]++;
+                sorted_keys[slot] = keys[i];
+                sorted_values[slot] = values[i];
+            }
+        }
+        keys.swap(sorted_keys);
+        values.swap(sorted_values);
+    }
+}
+
+// Builds the tree into nodes linked by index, allocated in any order so that
+// tasks can build subtrees side by side, then lays it out depth first.
+struct TreeBuilder {
+    struct Node {
+        Vec3f min, max;
+        unsigned first, count; // items of a leaf
+        unsigned left, right;
+    };
+    const std::vector<Vec3f> &min, &max;
+    std::vector<unsigned> &order;
+    BvhMethod method;
+    std::vector<Vec3f> centers;
+    std::vector<unsigned> codes; // LBVH: Morton code of the center of every item, in order
+    std::vector<Node> nodes;
+    std::atomic<unsigned> allocated;
+
+    TreeBuilder(const std::vector<Vec3f> &min, const std::vector<Vec3f> &max, std::vector<unsigned> &order,
+                BvhMethod method, unsigned threads);
+    void sort_morton(unsigned threads);
+    unsigned build(unsigned first, unsigned count, unsigned depth);
+    // number of items of the left child
+    unsigned split(unsigned first, unsigned count, unsigned depth);
+    unsigned median_split(unsigned first, unsigned count, const Vec3f &lo, const Vec3f &hi);
+    unsigned sah_split(unsigned first, unsigned count, const Vec3f &lo, const Vec3f &hi);
+    unsigned lbvh_split(unsigned first, unsigned count);
+    void bin(unsigned begin, unsigned end, const Vec3f &lo, const Vec3f &scale, Bins &bins) const;
+    void lay_out(unsigned n, std::vector<Bvh::Node> &out) const;
+};
+
+TreeBuilder::TreeBuilder(const std::vector<Vec3f> &min, const std::vector<Vec3f> &max, std::vector<unsigned> &order,
+                         BvhMethod method, unsigned threads)
+    : min(min), max(max), order(order), method(method), centers(min.size()), nodes(2 * min.size()), allocated(0)
+{
+    const int n = min.size();
+#pragma omp parallel for num_threads(threads) if (threads > 1)
+    for (int i = 0; i < n; i++)
+        centers[i] = (min[i] + max[i]) * .5f;
+    if (method == BVH_LBVH)
+        sort_morton(threads);
+}
+
+void TreeBuilder::sort_morton(unsigned threads)
+{
+    const int n = order.size();
+    Vec3f lo(1e30, 1e30, 1e30), hi(-1e30, -1e30, -1e30);
+    for (int i = 0; i < n; i++)
+        for (size_t k = 0; k < 3; k++)
+        {
+            lo[k] = std::min(lo[k], centers[i][k]);
+            hi[k] = std::max(hi[k], centers[i][k]);
+        }
+    Vec3f scale;
+    for (size_t k = 0; k < 3; k++)
+        scale[k] = hi[k] > lo[k] ? 1023 / (hi[k] - lo[k]) : 0;
+    codes.resize(n);
+#pragma omp parallel for num_threads(threads) if (threads > 1)
+    for (int i = 0; i < n; i++)
+    {
+        unsigned x = (centers[i].x - lo.x) * scale.x, y = (centers[i].y - lo.y) * scale.y,
+                 z = (centers[i].z - lo.z) * scale.z;
+        codes[i] = expand_bits(x) << 2 | expand_bits(y) << 1 | expand_bits(z);
+    }
+    radix_sort(codes, order, threads);
+}
+
+unsigned TreeBuilder::build(unsigned first, unsigned count, unsigned depth)
+{
+    unsigned index = allocated++;
+    if (count <= BVH_LEAF_SIZE)
+    {
+        Node &leaf = nodes[index];
+        leaf.min = Vec3f(1e30, 1e30, 1e30);
+        leaf.max = Vec3f(-1e30, -1e30, -1e30);
+        for (unsigned i = first; i < first + count; i++)
+            for (size_t k = 0; k < 3; k++)
+            {
+                leaf.min[k] = std::min(leaf.min[k], min[order[i]][k]);
+                leaf.max[k] = std::max(leaf.max[k], max[order[i]][k]);
+            }
+        leaf.first = first;
+        leaf.count = count;
+        return index;
+    }
+
+    unsigned half = split(first, count, depth);
+#pragma omp task if (count > BVH_TASK_ITEMS)
+    nodes[index].left = build(first, half, depth + 1);
+    nodes[index].right = build(first + half, count - half, depth + 1);
+#pragma omp taskwait
+    Node &node = nodes[index];
+    const Node &left = nodes[node.left], &right = nodes[node.right];
+    for (size_t k = 0; k < 3; k++)
+    {
+        node.min[k] = std::min(left.min[k], right.min[k]);
+        node.max[k] = std::max(left.max[k], right.max[k]);
+    }
+    node.first = node.count = 0;
+    return index;
+}
+
+unsigned TreeBuilder::split(unsigned first, unsigned count, unsigned depth)
+{
+    if (method == BVH_LBVH)
+        return lbvh_split(first, count);
+    Vec3f lo(1e30, 1e30, 1e30), hi(-1e30, -1e30, -1e30); // of the centers
+    for (unsigned i = first; i < first + count; i++)
+        for (size_t k = 0; k < 3; k++)
+        {
+            lo[k] = std::min(lo[k], centers[order[i]][k]);
+            hi[k] = std::max(hi[k], centers[order[i]][k]);
+        }
+    unsigned half = 0;
+    if (method == BVH_SAH && depth < 32)
+        half = sah_split(first, count, lo, hi);
+    return half ? half : median_split(first, count, lo, hi);
+}
+
+unsigned TreeBuilder::median_split(unsigned first, unsigned count, const Vec3f &lo, const Vec3f &hi)
+{
+    size_t axis = 0;
+    for (size_t k = 1; k < 3; k++)
+        if (hi[k] - lo[k] > hi[axis] - lo[axis])
+            axis = k;
+    unsigned half = count / 2;
+    std::nth_element(order.begin() + first, order.begin() + first + half, order.begin() + first + count,
+                     [&](unsigned a, unsigned b) { return centers[a][axis] < centers[b][axis]; });
+    return half;
+}
+
+static int bin_of(float center, float lo, float scale)
+{
+    return std::min(BVH_BINS - 1, int((center - lo) * scale));
+}
+
+void TreeBuilder::bin(unsigned begin, unsigned end, const Vec3f &lo, const Vec3f &scale, Bins &bins) const
+{
+    for (unsigned i = begin; i < end; i++)
+    {
+        unsigned item = order[i];
+        for (size_t k = 0; k < 3; k++)
+            bins.bin[k][bin_of(centers[item][k], lo[k], scale[k])].add(min[item], max[item]);
+    }
+}
+
+// the plane between two bins minimizing the areas of the children weighted by their item counts,
+// 0 if all the centers are at the same place
+unsigned TreeBuilder::sah_split(unsigned first, unsigned count, const Vec3f &lo, const Vec3f &hi)
+{
+    Vec3f scale;
+    for (size_t k = 0; k < 3; k++)
+        scale[k] = hi[k] > lo[k] ? BVH_BINS / (hi[k] - lo[k]) : 0;
+    Bins bins;
+    if (count > BVH_TASK_ITEMS)
+    {
+        // the top nodes hold most items: their chunks are binned by tasks, then merged
+        unsigned chunks = std::min(count / BVH_TASK_ITEMS, 64u);
+        std::vector<Bins> partial(chunks);
+        for (unsigned c = 0; c < chunks; c++)
+        {
+#pragma omp task shared(partial, lo, scale)
+            bin(first + size_t(count) * c / chunks, first + size_t(count) * (c + 1) / chunks, lo, scale, partial[c]);
+        }
+#pragma omp taskwait
+        for (unsigned c = 0; c < chunks; c++)
+            for (size_t k = 0; k < 3; k++)
+                for (int b = 0; b < BVH_BINS; b++)
+                    bins.bin[k][b].add(partial[c].bin[k][b]);
+    }
+    else
+        bin(first, first + count, lo, scale, bins);
+
+    float best = std::numeric_limits<float>::max();
+    size_t axis = 0;
+    int plane = -1; // the left child takes the bins up to this one
+    for (size_t k = 0; k < 3; k++)
+    {
+        if (!scale[k])
+            continue;
+        float left_area[BVH_BINS];
+        unsigned left_count[BVH_BINS];
+        Bin left, right;
+        for (int b = 0; b < BVH_BINS - 1; b++)
+        {
+            left.add(bins.bin[k][b]);
+            left_area[b] = left.count ? area(left.min, left.max) : 0;
+            left_count[b] = left.count;
+        }
+        for (int b = BVH_BINS - 1; b > 0; b--)
+        {
+            right.add(bins.bin[k][b]);
+            if (!left_count[b - 1] || !right.count)
+                continue;
+            float cost = left_area[b - 1] * left_count[b - 1] + area(right.min, right.max) * right.count;
+            if (cost < best)
+            {
+                best = cost;
+                axis = k;
+                plane = b - 1;
+            }
+        }
+    }
+    if (plane < 0)
+        return 0;
+    return std::partition(order.begin() + first, order.begin() + first + count,
+                          [&](unsigned i) { return bin_of(centers[i][axis], lo[axis], scale[axis]) <= plane; }) -
+           (order.begin() + first);
+}
+
+// where the highest bit the codes of the items differ by turns to 1
+unsigned TreeBuilder::lbvh_split(unsigned first, unsigned count)
+{
+    unsigned a = codes[first], b = codes[first + count - 1];
+    if (a == b)
+        return count / 2; // all in the same cell of the curve
+    unsigned bit = 1u << (31 - __builtin_clz(a ^ b));
+    return std::partition_point(codes.begin() + first, codes.begin() + first + count,
+                                [&](unsigned c) { return !(c & bit); }) -
+           (codes.begin() + first);
+}
+
+void TreeBuilder::lay_out(unsigned n, std::vector<Bvh::Node> &out) const
+{
+    const Node &node = nodes[n];
+    unsigned index = out.size();
+    Bvh::Node flat;
+    flat.min = node.min;
+    flat.max = node.max;
+    flat.first = node.first;
+    flat.count = node.count;
+    flat.right = 0;
+    out.push_back(flat);
+    if (node.count)
+        return;
+    lay_out(node.left, out);
+    out[index].right = out.size();
+    lay_out(node.right, out);
+}
+
+void Bvh::build(const std::vector<Vec3f> &min, const std::vector<Vec3f> &max, BvhMethod method, unsigned threads)
+{
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    nodes.clear();
+    order.resize(min.size());
+    for (unsigned i = 0; i < order.size(); i++)
+        order[i] = i;
+    if (!order.empty())
+    {
+        TreeBuilder builder(min, max, order, method, threads);
+#pragma omp parallel num_threads(threads) if (threads > 1)
+#pragma omp single
+        builder.build(0, order.size(), 0);
+        nodes.reserve(builder.allocated);
+        builder.lay_out(0, nodes);
+    }
+    build_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+void morton_order(const std::vector<Vec3f> &min, const std::vector<Vec3f> &max, std::vector<unsigned> &order)
+{
+    order.resize(min.size());
+    for (unsigned i = 0; i < order.size(); i++)
+        order[i] = i;
+    TreeBuilder builder(min, max, order, BVH_LBVH, 1); // sorts order
+}
+
+void Bvh::refit(const std::vector<Vec3f> &min, const std::vector<Vec3f> &max)
+{
+    // children come after their parent
+    for (size_t n = nodes.size(); n--;)
+    {
+        Node &node = nodes[n];
+        if (node.count)
+        {
+            node.min = Vec3f(1e30, 1e30, 1e30);
+            node.max = Vec3f(-1e30, -1e30, -1e30);
+            for (unsigned i = node.first; i < node.first + node.count; i++)
+                for (size_t k = 0; k < 3; k++)
+                {
+                    node.min[k] = std::min(node.min[k], min[order[i]][k]);
+                    node.max[k] = std::max(node.max[k], max[order[i]][k]);
+                }
+            continue;
+        }
+        const Node &left = nodes[n + 1], &right = nodes[node.right];
+        for (size_t k = 0; k < 3; k++)
+        {
+            node.min[k] = std::min(left.min[k], right.min[k]);
+            node.max[k] = std::max(left.max[k], right.max[k]);
+        }
+    }
+}
+
+BvhStats Bvh::stats() const
+{
+    BvhStats stats;
+    stats.build_ms = build_ms;
+    stats.nodes = nodes.size();
+    stats.leaves = stats.depth = 0;
+    stats.box_tests = stats.item_tests = 0;
+    if (nodes.empty())
+        return stats;
+    // a ray entering a node enters its children with the probability of the ratio of their areas
+    float root = area(nodes[0].min, nodes[0].max);
+    std::vector<unsigned> depth(nodes.size());
+    for (size_t n = 0; n < nodes.size(); n++)
+    {
+        const Node &node = nodes[n];
+        float p = root > 0 ? area(node.min, node.max) / root : 1;
+        stats.depth = std::max(stats.depth, depth[n]);
+        if (node.count)
+        {
+            stats.leaves++;
+            stats.item_tests += p * node.count;
+        }
+        else
+        {
+            stats.box_tests += 2 * p;
+            depth[n + 1] = depth[node.right] = depth[n] + 1;
+        }
+    }
+    return stats;
+}
+
+std::ostream &operator<<(std::ostream &out, const BvhStats &stats)
+{
+    return out << stats.build_ms << " ms, " << stats.nodes << " nodes, " << stats.leaves << " leaves, depth "
+               << stats.depth << ", " << stats.box_tests << " box and " << stats.item_tests << " item tests per ray";
+}
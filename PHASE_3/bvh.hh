@@ -0,0 +1,155 @@
+#ifndef _BVH_HH
+#define _BVH_HH
+
+#include <vector>
+#include <algorithm>
+#include <iostream>
+
+#include "geometry.hh"
+
+// items per leaf of the tree
+#define BVH_LEAF_SIZE 4
+// traversal stack. Past depth 32 the builders split at the median, which keeps
+// the trees of up to 2^32 items shallower.
+#define BVH_STACK 64
+// candidate split planes per axis of the surface area heuristic
+#define BVH_BINS 16
+// subtrees of more items are built by a task of their own
+#define BVH_TASK_ITEMS 4096
+
+// how Bvh::build splits the items
+enum BvhMethod {
+  BVH_MEDIAN, // halves along the largest extent of the centers, for a few items
+  BVH_SAH,    // binned surface area heuristic: the trees cheapest to traverse
+  BVH_LBVH    // items sorted along a Morton curve and split where the codes differ: the fastest to build
+};
+// "median", "sah" or "lbvh"
+bool parse_bvh_method(const char *name, BvhMethod &method);
+const char *bvh_method_name(BvhMethod method);
+
+// what a tree cost to build and should cost to traverse
+struct BvhStats {
+  double build_ms;
+  size_t nodes, leaves;
+  unsigned depth;
+  // per ray entering the root box, from the surface areas of the nodes
+  float box_tests, item_tests;
+};
+std::ostream &operator<<(std::ostream &out, const BvhStats &stats);
+
+// indices of the boxes in the order of their centers along a Morton curve, the order the
+// LBVH builder splits: boxes next to each other in it are close in space
+void morton_order(const std::vector<Vec3f> &min, const std::vector<Vec3f> &max, std::vector<unsigned> &order);
+
+// whether the ray enters the box before dist, near is then where (0 if orig is inside)
+inline bool ray_box(const Vec3f &min, const Vec3f &max, const Vec3f &orig, const Vec3f &inv_dir, float dist, float &near) {
+  float far = dist;
+  near = 0;
+  for (size_t k = 0; k < 3; k++) {
+    float t0 = (min[k] - orig[k]) * inv_dir[k], t1 = (max[k] - orig[k]) * inv_dir[k];
+    near = std::max(near, std::min(t0, t1));
+    far = std::min(far, std::max(t0, t1));
+  }
+  return near <= far;
+}
+
+// Bounding volume hierarchy over items the caller knows by their index and
+// bounding box. The nodes are stored depth first, a left child follows its parent.
+class Bvh {
+  struct Node {
+    Vec3f min, max;
+    unsigned first, count; // items of a leaf, in order
+    unsigned right;        // inner node: children are this node + 1 and right
+  };
+  std::vector<Node> nodes;
+  std::vector<unsigned> order;
+  double build_ms;
+  friend struct TreeBuilder;
+  friend class CompressedMesh;
+
+public:
+  Bvh() : build_ms(0) {};
+  // threads share the work of the SAH and LBVH builders
+  void build(const std::vector<Vec3f> &min, const std::vector<Vec3f> &max, BvhMethod method = BVH_MEDIAN,
+             unsigned threads = 1);
+  // updates the boxes of the nodes after the items moved, the tree is kept
+  void refit(const std::vector<Vec3f> &min, const std::vector<Vec3f> &max);
+  bool empty() const { return nodes.empty(); };
+  size_t bytes() const { return nodes.size() * sizeof(Node) + order.size() * sizeof(unsigned); };
+  BvhStats stats() const;
+
+  // calls visit(item) for every item whose box holds p
+  template <typename Visit>
+  void query(const Vec3f &p, Visit visit) const {
+    size_t top = 0;
+    if (nodes.empty())
+      return;
+    unsigned stack[BVH_STACK];
+    unsigned n = 0;
+    for (;;) {
+      const Node &node = nodes[n];
+      bool inside = p.x >= node.min.x && p.y >= node.min.y && p.z >= node.min.z && p.x <= node.max.x &&
+                    p.y <= node.max.y && p.z <= node.max.z;
+      if (inside && node.count) {
+        for (unsigned i = node.first; i < node.first + node.count; i++)
+          visit(order[i]);
+      } else if (inside) {
+        stack[top++] = node.right;
+        n++;
+        continue;
+      }
+      if (!top)
+        return;
+      n = stack[--top];
+    }
+  }
+
+  // calls test(item, dist) for every item whose box the ray enters before dist,
+  // near nodes first; test shortens dist when it hits the item. Returns the number of tests.
+  // always inlined: a call costs as much as testing a lone item
+  template <typename Test>
+  __attribute__((always_inline)) size_t traverse(const Vec3f &orig, const Vec3f &dir, float &dist, Test test) const {
+    size_t top = 0, tests = 0;
+    if (nodes.empty())
+      return 0;
+    // a lone leaf costs less to test than its box
+    if (nodes[0].count) {
+      for (unsigned i = 0; i < nodes[0].count; i++, tests++)
+        test(order[i], dist);
+      return tests;
+    }
+    float near, near_right;
+    const Vec3f inv_dir(1 / dir.x, 1 / dir.y, 1 / dir.z);
+    if (!ray_box(nodes[0].min, nodes[0].max, orig, inv_dir, dist, near))
+      return 0;
+    unsigned stack[BVH_STACK];
+    unsigned n = 0;
+    for (;;) {
+      const Node &node = nodes[n];
+      if (node.count) {
+        for (unsigned i = node.first; i < node.first + node.count; i++, tests++)
+          test(order[i], dist);
+      } else {
+        bool left = ray_box(nodes[n + 1].min, nodes[n + 1].max, orig, inv_dir, dist, near);
+        bool right = ray_box(nodes[node.right].min, nodes[node.right].max, orig, inv_dir, dist, near_right);
+        if (left && right) {
+          stack[top++] = near_right < near ? n + 1 : node.right;
+          n = near_right < near ? node.right : n + 1;
+          continue;
+        }
+        if (left || right) {
+          n = left ? n + 1 : node.right;
+          continue;
+        }
+      }
+      // the nodes left behind may lie beyond the hit found since
+      do {
+        if (!top)
+          return tests;
+        n = stack[--top];
+      } while (!ray_box(nodes[n].min, nodes[n].max, orig, inv_dir, dist, near));
+    }
+  }
+};
+
+#endif
@@ -0,0 +1,161 @@
+#include <cmath>
+#include <limits>
+#include <algorithm>
+
+#include "cmesh.hh"
+
+static_assert(BVH_LEAF_SIZE <= CMESH_WIDTH && 3 * BVH_LEAF_SIZE <= 256, "leaves too large for the compressed mesh");
+
+size_t CompressedMesh::bytes() const
+{
+    return nodes.size() * sizeof(Node) + leaves.size() * sizeof(Leaf) + positions.size() * sizeof(Position) +
+           strips.size();
+}
+
+void CompressedMesh::build(const std::vector<Vec3f> &verts, const std::vector<Vec3i> &faces, const Vec3f &min,
+                           const Vec3f &max, const Bvh &bvh)
+{
+    nodes.clear();
+    leaves.clear();
+    positions.clear();
+    strips.clear();
+    if (bvh.empty())
+        return;
+
+    std::vector<Position> quantized(verts.size());
+    for (size_t k = 0; k < 3; k++)
+    {
+        origin[k] = min[k];
+        scale[k] = (max[k] - min[k]) / 65535;
+    }
+    for (size_t v = 0; v < verts.size(); v++)
+    {
+        uint16_t q[3];
+        for (size_t k = 0; k < 3; k++)
+            q[k] = scale[k] > 0 ? std::max(0.f, std::min(65535.f, rintf((verts[v][k] - min[k]) / scale[k]))) : 0;
+        quantized[v] = Position{q[0], q[1], q[2]};
+    }
+
+    // the leaves in tree order, boxed around their quantized corners and padded as Model::build_bvh pads
+    const size_t count = bvh.nodes.size();
+    const float pad = 1e-5 * (max - min).norm();
+    std::vector<Vec3f> lo(count), hi(count);
+    std::vector<unsigned> leaf_of(count);
+    for (size_t n = 0; n < count; n++)
+    {
+        const Bvh::Node &node = bvh.nodes[n];
+        if (!node.count)
+            continue;
+        leaf_of[n] = leaves.size();
+        leaves.push_back(Leaf{unsigned(positions.size()), unsigned(triangles())});
+        unsigned run[3 * BVH_LEAF_SIZE], size = 0;
+        for (unsigned i = node.first; i < node.first + node.count; i++)
+            for (size_t j = 0; j < 3; j++)
+            {
+                unsigned v = faces[bvh.order[i]][j], local = std::find(run, run + size, v) - run;
+                if (local == size)
+                {
+                    run[size++] = v;
+                    positions.push_back(quantized[v]);
+                }
+                strips.push_back(local);
+            }
+        lo[n] = Vec3f(1e30, 1e30, 1e30);
+        hi[n] = Vec3f(-1e30, -1e30, -1e30);
+        for (unsigned v = leaves.back().vertex; v < positions.size(); v++)
+        {
+            Vec3f p = tree().position(v);
+            for (size_t k = 0; k < 3; k++)
+            {
+                lo[n][k] = std::min(lo[n][k], p[k] - pad);
+                hi[n][k] = std::max(hi[n][k], p[k] + pad);
+            }
+        }
+    }
+    leaves.push_back(Leaf{unsigned(positions.size()), unsigned(triangles())});
+    // children follow their parent
+    for (size_t n = count; n--;)
+        if (!bvh.nodes[n].count)
+            for (size_t k = 0; k < 3; k++)
+            {
+                lo[n][k] = std::min(lo[n + 1][k], lo[bvh.nodes[n].right][k]);
+                hi[n][k] = std::max(hi[n + 1][k], hi[bvh.nodes[n].right][k]);
+            }
+
+    // every node takes the largest of its binary descendants until it has eight children
+    std::vector<std::pair<unsigned, unsigned>> todo(1, std::make_pair(0u, 0u)); // node to fill, from binary node
+    nodes.resize(1);
+    while (!todo.empty())
+    {
+        unsigned wide = todo.back().first, n = todo.back().second, children[CMESH_WIDTH], width = 0;
+        todo.pop_back();
+        if (bvh.nodes[n].count)
+            children[width++] = n;
+        else
+        {
+            children[width++] = n + 1;
+            children[width++] = bvh.nodes[n].right;
+        }
+        while (width < CMESH_WIDTH)
+        {
+            int largest = -1;
+            float largest_area = 0;
+            for (unsigned c = 0; c < width; c++)
+            {
+                if (bvh.nodes[children[c]].count)
+                    continue;
+                Vec3f e = hi[children[c]] - lo[children[c]];
+                float area = e.x * e.y + e.y * e.z + e.z * e.x;
+                if (largest < 0 || area > largest_area)
+                {
+                    largest = c;
+                    largest_area = area;
+                }
+            }
+            if (largest < 0)
+                break;
+            unsigned opened = children[largest];
+            children[largest] = opened + 1;
+            children[width++] = bvh.nodes[opened].right;
+        }
+
+        Node node;
+        for (size_t k = 0; k < 3; k++)
+        {
+            node.origin[k] = lo[n][k];
+            node.scale[k] = std::max((hi[n][k] - lo[n][k]) / 255, std::numeric_limits<float>::min());
+        }
+        for (unsigned c = 0; c < CMESH_WIDTH; c++)
+        {
+            if (c >= width)
+            {
+                node.child[c] = ~0u;
+                for (size_t k = 0; k < 3; k++)
+                    node.lo[k][c] = node.hi[k][c] = 0;
+                continue;
+            }
+            unsigned b = children[c];
+            // rounded outwards, in the arithmetic of the decoding
+            for (size_t k = 0; k < 3; k++)
+            {
+                int q0 = std::max(0.f, floorf((lo[b][k] - node.origin[k]) / node.scale[k]));
+                int q1 = std::min(255.f, ceilf((hi[b][k] - node.origin[k]) / node.scale[k]));
+                while (q0 > 0 && node.origin[k] + q0 * node.scale[k] > lo[b][k])
+                    q0--;
+                while (q1 < 255 && node.origin[k] + q1 * node.scale[k] < hi[b][k])
+                    q1++;
+                node.lo[k][c] = q0;
+                node.hi[k][c] = q1;
+            }
+            if (bvh.nodes[b].count)
+                node.child[c] = leaf_of[b] | CMESH_LEAF;
+            else
+            {
+                node.child[c] = nodes.size();
+                nodes.push_back(Node());
+                todo.push_back(std::make_pair(node.child[c], b));
+            }
+        }
+        nodes[wide] = node;
+    }
+}
@@ -0,0 +1,162 @@
+#ifndef _CMESH_HH
+#define _CMESH_HH
+
+#include <vector>
+#include <cstdint>
+
+#include "geometry.hh"
+#include "bvh.hh"
+
+// children of a node of the compressed tree
+#define CMESH_WIDTH 8
+// flags a leaf among the children of a node
+#define CMESH_LEAF 0x80000000u
+
+// A triangle mesh and its tree in about half the memory of Model:
+// - vertex positions are 16 bit fractions of the mesh bounding box,
+// - the tree has 8 children per node, whose boxes are 8 bit fractions of the node box,
+// - every leaf has its own run of vertices, which its triangles index with one byte each.
+// The positions move by up to 1/131070 of the box, the hits move as little.
+class CompressedMesh {
+public:
+  struct Node {
+    float origin[3], scale[3]; // child bounds are origin + q * scale
+    uint8_t lo[3][CMESH_WIDTH], hi[3][CMESH_WIDTH];
+    unsigned child[CMESH_WIDTH]; // a node, a leaf | CMESH_LEAF, or ~0u when empty
+  };
+  struct Leaf {
+    unsigned vertex, triangle; // first vertex and first triangle, the next leaf starts where this one ends
+  };
+  struct Position {
+    uint16_t x, y, z;
+  };
+
+  // calls visit(child, dist) for the leaves under root (a node, or a leaf | CMESH_LEAF) whose boxes
+  // the ray enters before dist, near boxes first; visit shortens dist when it hits something
+  template <typename Visit>
+  __attribute__((always_inline)) static void walk(const Node *nodes, unsigned root, const Vec3f &orig, const Vec3f &dir,
+                                                  float &dist, Visit visit) {
+    struct Entry {
+      unsigned ref;
+      float near;
+    } stack[CMESH_WIDTH * BVH_STACK];
+    size_t top = 0;
+    const float inv_dir[3] = {1 / dir.x, 1 / dir.y, 1 / dir.z};
+    stack[top++] = Entry{root, 0};
+    while (top) {
+      const Entry entry = stack[--top];
+      // a hit found since may lie before the box
+      if (entry.near > dist)
+        continue;
+      if (entry.ref & CMESH_LEAF) {
+        visit(entry.ref & ~CMESH_LEAF, dist);
+        continue;
+      }
+
+      // the slabs of the eight children at once, t = a + q * b along each axis
+      const Node &node = nodes[entry.ref];
+      float a[3], b[3], near[CMESH_WIDTH], far[CMESH_WIDTH];
+      const float d = dist;
+      for (size_t k = 0; k < 3; k++) {
+        a[k] = (node.origin[k] - orig[k]) * inv_dir[k];
+        b[k] = node.scale[k] * inv_dir[k];
+      }
+      for (size_t c = 0; c < CMESH_WIDTH; c++) {
+        float x0 = a[0] + node.lo[0][c] * b[0], x1 = a[0] + node.hi[0][c] * b[0];
+        float y0 = a[1] + node.lo[1][c] * b[1], y1 = a[1] + node.hi[1][c] * b[1];
+        float z0 = a[2] + node.lo[2][c] * b[2], z1 = a[2] + node.hi[2][c] * b[2];
+        near[c] = std::max(std::max(0.f, std::min(x0, x1)), std::max(std::min(y0, y1), std::min(z0, z1)));
+        far[c] = std::min(std::min(d, std::max(x0, x1)), std::min(std::max(y0, y1), std::max(z0, z1)));
+      }
+      // the children entered, farthest pushed first so that the nearest is walked next
+      size_t first = top;
+      for (size_t c = 0; c < CMESH_WIDTH; c++)
+        if (near[c] <= far[c] && node.child[c] != ~0u) {
+          size_t i = top++;
+          for (; i > first && stack[i - 1].near < near[c]; i--)
+            stack[i] = stack[i - 1];
+          stack[i] = Entry{node.child[c], near[c]};
+        }
+    }
+  }
+
+  // the arrays of a tree, held by a CompressedMesh or mapped from a file
+  struct Tree {
+    const Node *nodes;
+    const Leaf *leaves; // and one past the last
+    const Position *positions;
+    const uint8_t *strips; // three vertices per triangle, within the run of its leaf
+    const float *origin, *scale; // positions are origin + q * scale
+    unsigned leaf_base;          // of the faces numbered by traverse
+
+    Vec3f position(unsigned v) const {
+      const Position &p = positions[v];
+      return Vec3f(origin[0] + p.x * scale[0], origin[1] + p.y * scale[1], origin[2] + p.z * scale[2]);
+    };
+    void corners(unsigned leaf, unsigned t, Vec3f &a, Vec3f &b, Vec3f &c) const {
+      const uint8_t *s = &strips[3 * t];
+      unsigned v = leaves[leaf].vertex;
+      a = position(v + s[0]);
+      b = position(v + s[1]);
+      c = position(v + s[2]);
+    };
+    // the corners of triangle t of leaf, false if there is no such triangle
+    bool triangle(unsigned leaf, unsigned t, Vec3f &a, Vec3f &b, Vec3f &c) const {
+      if (leaves[leaf].triangle + t >= leaves[leaf + 1].triangle)
+        return false;
+      corners(leaf, leaves[leaf].triangle + t, a, b, c);
+      return true;
+    };
+
+    // calls test(face, a, b, c, dist) for the triangles whose boxes the ray enters before dist,
+    // near boxes first, as Bvh::traverse does. Returns the number of tests.
+    template <typename Test>
+    __attribute__((always_inline)) size_t traverse(unsigned root, const Vec3f &orig, const Vec3f &dir, float &dist,
+                                                   Test test) const {
+      size_t tests = 0;
+      walk(nodes, root, orig, dir, dist, [&](unsigned leaf, float &d) {
+        for (unsigned t = leaves[leaf].triangle; t < leaves[leaf + 1].triangle; t++, tests++) {
+          Vec3f a, b, c;
+          corners(leaf, t, a, b, c);
+          test((leaf_base + leaf) * CMESH_WIDTH + t - leaves[leaf].triangle, a, b, c, d);
+        }
+      });
+      return tests;
+    }
+  };
+
+private:
+  float origin[3], scale[3]; // positions are origin + q * scale
+  std::vector<Node> nodes;
+  std::vector<Leaf> leaves; // and one past the last
+  std::vector<Position> positions;
+  std::vector<uint8_t> strips;
+  friend class TreeletMesh;
+
+  Tree tree() const { return Tree{nodes.data(), leaves.data(), positions.data(), strips.data(), origin, scale, 0}; };
+
+public:
+  CompressedMesh() {
+    for (size_t k = 0; k < 3; k++)
+      origin[k] = scale[k] = 0;
+  };
+  // from a mesh, its bounding box and a tree over its faces
+  void build(const std::vector<Vec3f> &verts, const std::vector<Vec3i> &faces, const Vec3f &min, const Vec3f &max,
+             const Bvh &bvh);
+  bool empty() const { return leaves.empty(); };
+  size_t triangles() const { return strips.size() / 3; };
+  size_t bytes() const;
+
+  // the corners of face, as traverse numbers the faces; false if there is no such face
+  bool triangle(unsigned face, Vec3f &a, Vec3f &b, Vec3f &c) const {
+    unsigned leaf = face / CMESH_WIDTH;
+    return leaf + 1 < leaves.size() && tree().triangle(leaf, face % CMESH_WIDTH, a, b, c);
+  };
+
+  template <typename Test>
+  __attribute__((always_inline)) size_t traverse(const Vec3f &orig, const Vec3f &dir, float &dist, Test test) const {
+    return nodes.empty() ? 0 : tree().traverse(0, orig, dir, dist, test);
+  }
+};
+
+#endif
@@ -0,0 +1,16 @@
+#include "dispatch.hh"
+
+const char *kernel_isa()
+{
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(__clang__) && !defined(NO_KERNEL_CLONES)
+    // same order of preference as the resolver generated for KERNEL_CLONES
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f"))
+        return "avx512f";
+    if (__builtin_cpu_supports("avx2"))
+        return "avx2";
+    if (__builtin_cpu_supports("sse4.2"))
+        return "sse4.2";
+#endif
+    return "baseline";
+}
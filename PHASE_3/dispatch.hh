@@ -0,0 +1,19 @@
+#ifndef _DISPATCH_HH
+#define _DISPATCH_HH
+
+// The hot kernels (intersection, shading, pixel conversion) are compiled once per
+// instruction set listed here; the dynamic loader picks the best one for the CPU
+// at startup (ifunc resolver reading CPUID), so one binary runs everywhere.
+// Define NO_KERNEL_CLONES to build the baseline variant only. Every variant rounds
+// as the baseline does: the Makefile builds with -ffp-contract=off, so that no clone
+// fuses multiply-adds, and renders do not depend on the CPU.
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(__clang__) && !defined(NO_KERNEL_CLONES)
+#define KERNEL_CLONES __attribute__((target_clones("avx512f", "avx2", "sse4.2", "default")))
+#else
+#define KERNEL_CLONES
+#endif
+
+// name of the kernel variant the loader selects on this CPU
+const char *kernel_isa();
+
+#endif
@@ -0,0 +1,57 @@
+#include <cassert>
+
+#include "display.hh"
+#include "trace.hh"
+
+FramePool::FramePool(unsigned w, unsigned h, size_t count)
+    : frame_size(4 * (size_t)w * h), storage(frame_size * count)
+{
+    for (size_t i = 0; i < count; i++)
+        free_frames.push_back(storage.data() + i * frame_size);
+}
+
+unsigned char *FramePool::acquire()
+{
+    std::lock_guard<std::mutex> lock(mx);
+    if (free_frames.empty())
+        return nullptr;
+    unsigned char *frame = free_frames.back();
+    free_frames.pop_back();
+    return frame;
+}
+
+void FramePool::release(unsigned char *frame)
+{
+    assert(frame >= storage.data() && frame < storage.data() + storage.size());
+    std::lock_guard<std::mutex> lock(mx);
+    free_frames.push_back(frame);
+}
+
+Display::Display(sf::RenderWindow &window, unsigned w, unsigned h)
+    : window(window), current(0), width(w), height(h), overlay(nullptr)
+{
+    for (size_t i = 0; i < DISPLAY_BUFFERS; i++)
+    {
+        textures[i].create(w, h);
+        textures[i].setSmooth(true); // the GPU does the bilinear upscaling of reduced frames
+    }
+    sprite.setTexture(textures[current]);
+}
+
+void Display::present(const unsigned char *pixels, unsigned w, unsigned h)
+{
+    current = (current + 1) % DISPLAY_BUFFERS;
+    {
+        TRACE_SCOPE("texture upload");
+        textures[current].update(pixels, w, h, 0, 0); // uploaded in place, the texture keeps its storage
+    }
+    sprite.setTexture(textures[current]);
+    sprite.setTextureRect(sf::IntRect(0, 0, w, h));
+    sprite.setScale(float(width) / w, float(height) / h);
+    TRACE_SCOPE("display");
+    window.clear();
+    window.draw(sprite);
+    if (overlay)
+        overlay->draw_overlay(window);
+    window.display();
+}
@@ -0,0 +1,46 @@
+#ifndef _DISPLAY_HH
+#define _DISPLAY_HH
+
+#include <vector>
+#include <mutex>
+#include <SFML/Graphics.hpp>
+
+#include "latency.hh"
+
+// number of textures the display cycles through, so that the one being
+// updated is never the one the driver may still be drawing from
+#define DISPLAY_BUFFERS 3
+
+// Fixed set of RGBA frame buffers shared by the compute threads and the display.
+// Buffers are allocated once and recycled, no image is ever copied on the way.
+class FramePool {
+  size_t frame_size;
+  std::vector<unsigned char> storage;
+  std::vector<unsigned char *> free_frames;
+  std::mutex mx;
+
+public:
+  FramePool(unsigned w, unsigned h, size_t count);
+  unsigned char *acquire(); // nullptr when every buffer is in use
+  void release(unsigned char *frame);
+};
+
+// Window backend keeping persistent textures updated in place from pooled frames
+class Display {
+  sf::RenderWindow &window;
+  sf::Texture textures[DISPLAY_BUFFERS];
+  sf::Sprite sprite;
+  unsigned current;
+  unsigned width, height;
+  const LatencyStats *overlay;
+
+public:
+  Display(sf::RenderWindow &window, unsigned w, unsigned h);
+  // pixels may hold a frame smaller than the window, it is then upscaled bilinearly
+  void present(const unsigned char *pixels, unsigned w, unsigned h);
+  // latency bars drawn over every frame, nullptr to hide them
+  void set_overlay(const LatencyStats *stats) { overlay = stats; };
+  const LatencyStats *get_overlay() const { return overlay; };
+};
+
+#endif
@@ -0,0 +1,86 @@
+#ifndef _FASTMATH_HH
+#define _FASTMATH_HH
+
+#include <cmath>
+#include <cstring>
+#include <stdint.h>
+#include <algorithm>
+
+#include "geometry.hh"
+
+// Branch-free approximations used by the fast shading mode (-fast-math).
+// Maximum errors against double precision, over every float argument for fast_log2
+// and fast_acos and over 2e7 random arguments for the others:
+//   fast_log2   1.6e-7 * max(1, |log2 x|) for normal x > 0
+//   fast_exp2   relative 2.4e-7 for x in [-126, 127], 0 below -127
+//   fast_pow    relative 1.4e-5 for the specular exponent 1425 of the mirror
+//   fast_rsqrt  relative 4.8e-6 (about 3e-7 with the SSE/NEON estimate)
+//   fast_atan2  absolute 1.2e-5 rad, a 0.004 pixel shift on a 2048 wide envmap
+//   fast_acos   absolute 4.4e-7 rad
+
+inline float fast_log2(float x) {
+  uint32_t i;
+  memcpy(&i, &x, 4);
+  // x = 2^e * m with m in [sqrt(1/2), sqrt(2)), so that t below stays under 0.172
+  int32_t e = int32_t((i - 0x3f3504f3) >> 23) - (i < 0x3f3504f3 ? 512 : 0);
+  i -= uint32_t(e) << 23;
+  float m;
+  memcpy(&m, &i, 4);
+  float t = (m - 1.f) / (m + 1.f), t2 = t * t;
+  // 2/ln(2) * atanh(t)
+  return e + t * (2.8853901f + t2 * (0.9617967f + t2 * (0.5770780f + t2 * 0.4121986f)));
+}
+
+inline float fast_exp2(float x) {
+  x = std::max(-127.f, std::min(127.f, x));
+  float n = std::floor(x + 0.5f), f = x - n; // f in [-1/2, 1/2]
+  float p = 1.f + f * (0.6931472f + f * (0.2402265f + f * (0.05550411f + f * (0.009618129f + f * (0.001333355f + f * 0.0001540353f)))));
+  uint32_t i = uint32_t(int32_t(n) + 127) << 23;
+  float s;
+  memcpy(&s, &i, 4);
+  return x > -127.f ? p * s : 0.f;
+}
+
+// x^y for x >= 0
+inline float fast_pow(float x, float y) {
+  return x > 0.f ? fast_exp2(y * fast_log2(x)) : 0.f;
+}
+
+inline float fast_rsqrt(float x) {
+#ifdef GEOMETRY_SIMD
+  return simd_rsqrt(x);
+#else
+  uint32_t i;
+  memcpy(&i, &x, 4);
+  i = 0x5f375a86 - (i >> 1);
+  float r;
+  memcpy(&r, &i, 4);
+  r = r * (1.5f - 0.5f * x * r * r);
+  return r * (1.5f - 0.5f * x * r * r);
+#endif
+}
+
+// atan on [-1, 1], Abramowitz & Stegun 4.4.49
+inline float fast_atan(float x) {
+  float x2 = x * x;
+  return x * (0.9998660f + x2 * (-0.3302995f + x2 * (0.1801410f + x2 * (-0.0851330f + x2 * 0.0208351f))));
+}
+
+inline float fast_atan2(float y, float x) {
+  float ax = std::fabs(x), ay = std::fabs(y);
+  float a = fast_atan(std::min(ax, ay) / std::max(std::max(ax, ay), 1e-30f));
+  a = ay > ax ? float(M_PI / 2) - a : a;
+  a = x < 0.f ? float(M_PI) - a : a;
+  return y < 0.f ? -a : a;
+}
+
+// Abramowitz & Stegun 4.4.46
+inline float fast_acos(float x) {
+  float ax = std::min(1.f, std::fabs(x));
+  float p = 1.5707963050f + ax * (-0.2145988016f + ax * (0.0889789874f + ax * (-0.0501743046f + ax * (0.0308918810f +
+            ax * (-0.0170881256f + ax * (0.0066700901f + ax * -0.0012624911f))))));
+  float a = std::sqrt(1.f - ax) * p;
+  return x < 0.f ? float(M_PI) - a : a;
+}
+
+#endif
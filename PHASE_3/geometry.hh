@@ -5,6 +5,17 @@
 #include <cassert>
 #include <iostream>
 
+// Vec3f and Vec4f are backed by one 128 bit SSE or NEON register unless
+// GEOMETRY_SCALAR is defined or the target has neither
+#if !defined(GEOMETRY_SCALAR) && (defined(__SSE2__) || defined(__ARM_NEON))
+#define GEOMETRY_SIMD
+#ifdef __SSE2__
+#include <immintrin.h>
+#else
+#include <arm_neon.h>
+#endif
+#endif
+
 template <size_t DIM, typename T> struct vec {
     vec() { for (size_t i=DIM; i--; data_[i] = T()); }
           T& operator[](const size_t i)       { assert(i<DIM); return data_[i]; }
@@ -32,7 +43,7 @@ template <typename T> struct vec<3,T> {
     vec(T X, T Y, T Z) : x(X), y(Y), z(Z) {}
           T& operator[](const size_t i)       { assert(i<3); return i<=0 ? x : (1==i ? y : z); }
     const T& operator[](const size_t i) const { assert(i<3); return i<=0 ? x : (1==i ? y : z); }
-    float norm() { return std::sqrt(x*x+y*y+z*z); }
+    float norm() const { return std::sqrt(x*x+y*y+z*z); }
     vec<3,T> & normalize(T l=1) { *this = (*this)*(l/norm()); return *this; }
     T x,y,z;
 };
@@ -45,6 +56,141 @@ template <typename T> struct vec<4,T> {
     T x,y,z,w;
 };
 
+#ifdef GEOMETRY_SIMD
+#ifdef __SSE2__
+typedef __m128 simd4f;
+inline simd4f simd_load(const float *p) { return _mm_load_ps(p); }
+inline void simd_store(float *p, simd4f v) { _mm_store_ps(p, v); }
+inline simd4f simd_set1(float f) { return _mm_set1_ps(f); }
+inline simd4f simd_add(simd4f a, simd4f b) { return _mm_add_ps(a, b); }
+inline simd4f simd_sub(simd4f a, simd4f b) { return _mm_sub_ps(a, b); }
+inline simd4f simd_mul(simd4f a, simd4f b) { return _mm_mul_ps(a, b); }
+inline simd4f simd_neg(simd4f a) { return _mm_xor_ps(a, _mm_set1_ps(-0.f)); }
+// a*b - c, fused only when the whole build targets FMA (-mfma), never per kernel clone
+inline simd4f simd_msub(simd4f a, simd4f b, simd4f c) {
+#ifdef __FMA__
+    return _mm_fmsub_ps(a, b, c);
+#else
+    return _mm_sub_ps(_mm_mul_ps(a, b), c);
+#endif
+}
+// (y,z,x,w)
+inline simd4f simd_yzx(simd4f a) { return _mm_shuffle_ps(a, a, _MM_SHUFFLE(3,0,2,1)); }
+// ((z + y) + x) + w, the order of the scalar loop below, so that both backends agree
+inline float simd_dot3(simd4f a, simd4f b) {
+    __m128 m = _mm_mul_ps(a, b);
+    __m128 y = _mm_shuffle_ps(m, m, _MM_SHUFFLE(1,1,1,1));
+    return _mm_cvtss_f32(_mm_add_ss(_mm_add_ss(_mm_movehl_ps(m, m), y), m));
+}
+inline float simd_dot4(simd4f a, simd4f b) {
+    __m128 m = _mm_mul_ps(a, b);
+    __m128 y = _mm_shuffle_ps(m, m, _MM_SHUFFLE(1,1,1,1));
+    __m128 w = _mm_shuffle_ps(m, m, _MM_SHUFFLE(3,3,3,3));
+    return _mm_cvtss_f32(_mm_add_ss(_mm_add_ss(_mm_add_ss(w, _mm_movehl_ps(m, m)), y), m));
+}
+// 1/sqrt(f), hardware estimate refined by one Newton-Raphson step (about 22 bits)
+inline float simd_rsqrt(float f) {
+    __m128 v = _mm_set_ss(f);
+    __m128 r = _mm_rsqrt_ss(v);
+    r = _mm_mul_ss(_mm_mul_ss(_mm_set_ss(0.5f), r),
+                   _mm_sub_ss(_mm_set_ss(3.f), _mm_mul_ss(_mm_mul_ss(v, r), r)));
+    return _mm_cvtss_f32(r);
+}
+#else
+typedef float32x4_t simd4f;
+inline simd4f simd_load(const float *p) { return vld1q_f32(p); }
+inline void simd_store(float *p, simd4f v) { vst1q_f32(p, v); }
+inline simd4f simd_set1(float f) { return vdupq_n_f32(f); }
+inline simd4f simd_add(simd4f a, simd4f b) { return vaddq_f32(a, b); }
+inline simd4f simd_sub(simd4f a, simd4f b) { return vsubq_f32(a, b); }
+inline simd4f simd_mul(simd4f a, simd4f b) { return vmulq_f32(a, b); }
+inline simd4f simd_neg(simd4f a) { return vnegq_f32(a); }
+inline simd4f simd_msub(simd4f a, simd4f b, simd4f c) { return vnegq_f32(vfmsq_f32(c, a, b)); }
+inline simd4f simd_yzx(simd4f a) {
+    float32x4_t r = vextq_f32(a, a, 1); // (y,z,w,x)
+    return vsetq_lane_f32(vgetq_lane_f32(a, 3), vsetq_lane_f32(vgetq_lane_f32(a, 0), r, 2), 3);
+}
+inline float simd_dot3(simd4f a, simd4f b) {
+    float32x4_t m = vmulq_f32(a, b);
+    return (vgetq_lane_f32(m, 2) + vgetq_lane_f32(m, 1)) + vgetq_lane_f32(m, 0);
+}
+inline float simd_dot4(simd4f a, simd4f b) {
+    float32x4_t m = vmulq_f32(a, b);
+    return ((vgetq_lane_f32(m, 3) + vgetq_lane_f32(m, 2)) + vgetq_lane_f32(m, 1)) + vgetq_lane_f32(m, 0);
+}
+// 1/sqrt(f), hardware estimate refined by two Newton-Raphson steps
+inline float simd_rsqrt(float f) {
+    float32x2_t v = vdup_n_f32(f);
+    float32x2_t r = vrsqrte_f32(v);
+    r = vmul_f32(r, vrsqrts_f32(vmul_f32(v, r), r));
+    r = vmul_f32(r, vrsqrts_f32(vmul_f32(v, r), r));
+    return vget_lane_f32(r, 0);
+}
+#endif
+
+// the 4th lane of a Vec3f is padding, kept at 0 by every operation
+template <> struct alignas(16) vec<3,float> {
+    vec() : x(0), y(0), z(0), pad(0) {}
+    vec(float X, float Y, float Z) : x(X), y(Y), z(Z), pad(0) {}
+    explicit vec(simd4f v) { simd_store(&x, v); }
+    simd4f simd() const { return simd_load(&x); }
+          float& operator[](const size_t i)       { assert(i<3); return (&x)[i]; }
+    const float& operator[](const size_t i) const { assert(i<3); return (&x)[i]; }
+    float norm() const;
+    vec<3,float> & normalize(float l=1);
+    float x,y,z;
+    float pad;
+};
+
+template <> struct alignas(16) vec<4,float> {
+    vec() : x(0), y(0), z(0), w(0) {}
+    vec(float X, float Y, float Z, float W) : x(X), y(Y), z(Z), w(W) {}
+    explicit vec(simd4f v) { simd_store(&x, v); }
+    simd4f simd() const { return simd_load(&x); }
+          float& operator[](const size_t i)       { assert(i<4); return (&x)[i]; }
+    const float& operator[](const size_t i) const { assert(i<4); return (&x)[i]; }
+    float x,y,z,w;
+};
+
+inline float operator*(const Vec3f& lhs, const Vec3f& rhs) { return simd_dot3(lhs.simd(), rhs.simd()); }
+inline float operator*(const Vec4f& lhs, const Vec4f& rhs) { return simd_dot4(lhs.simd(), rhs.simd()); }
+
+inline Vec3f operator+(const Vec3f& lhs, const Vec3f& rhs) { return Vec3f(simd_add(lhs.simd(), rhs.simd())); }
+inline Vec4f operator+(const Vec4f& lhs, const Vec4f& rhs) { return Vec4f(simd_add(lhs.simd(), rhs.simd())); }
+inline Vec3f operator-(const Vec3f& lhs, const Vec3f& rhs) { return Vec3f(simd_sub(lhs.simd(), rhs.simd())); }
+inline Vec4f operator-(const Vec4f& lhs, const Vec4f& rhs) { return Vec4f(simd_sub(lhs.simd(), rhs.simd())); }
+inline Vec3f operator-(const Vec3f& lhs) { return Vec3f(simd_neg(lhs.simd())); }
+inline Vec4f operator-(const Vec4f& lhs) { return Vec4f(simd_neg(lhs.simd())); }
+
+template <typename U> Vec3f operator*(const Vec3f& lhs, const U& rhs) {
+    return Vec3f(simd_mul(lhs.simd(), simd_set1(float(rhs))));
+}
+
+template <typename U> Vec4f operator*(const Vec4f& lhs, const U& rhs) {
+    return Vec4f(simd_mul(lhs.simd(), simd_set1(float(rhs))));
+}
+
+// double factors multiply in double, as the scalar template promotes them, then round once
+inline Vec3f operator*(const Vec3f& lhs, const double& rhs) {
+    return Vec3f(float(lhs.x*rhs), float(lhs.y*rhs), float(lhs.z*rhs));
+}
+
+inline Vec4f operator*(const Vec4f& lhs, const double& rhs) {
+    return Vec4f(float(lhs.x*rhs), float(lhs.y*rhs), float(lhs.z*rhs), float(lhs.w*rhs));
+}
+
+// a.yzx*b.zxy - a.zxy*b.yzx, computed as (a*b.yzx - a.yzx*b).yzx
+inline Vec3f cross(const Vec3f& v1, const Vec3f& v2) {
+    simd4f a = v1.simd(), b = v2.simd();
+    return Vec3f(simd_yzx(simd_msub(a, simd_yzx(b), simd_mul(simd_yzx(a), b))));
+}
+
+// summed from x as the scalar template sums, rather than from z as the dot product does
+inline float Vec3f::norm() const { return std::sqrt(x*x+y*y+z*z); }
+// l/norm() as the scalar template divides, so that the SIMD vectors shade as the original ones do
+inline Vec3f & Vec3f::normalize(float l) { *this = (*this)*(l/norm()); return *this; }
+#endif
+
 template<size_t DIM,typename T> T operator*(const vec<DIM,T>& lhs, const vec<DIM,T>& rhs) {
     T ret = T();
     for (size_t i=DIM; i--; ret+=lhs[i]*rhs[i]);
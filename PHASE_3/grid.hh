@@ -0,0 +1,52 @@
+#ifndef _GRID_HH
+#define _GRID_HH
+
+#include <vector>
+
+#include "geometry.hh"
+
+// cells per sphere the grid resolution aims at
+#define GRID_DENSITY 1
+// most cells along one axis
+#define GRID_MAX_RESOLUTION 512
+
+// Uniform grid over spheres that move every frame. Building it is two passes
+// over the spheres (count the spheres per cell, then file them) split among
+// threads, cheap enough to redo per frame where a tree could only be refit.
+// Rays walk the cells they cross in order (3D-DDA) and stop after the cell
+// holding the closest hit.
+class SphereGrid {
+  Vec3f lo, hi;            // bounds of the grid
+  Vec3f cell_size, inv_cell_size;
+  int resolution[3];
+  std::vector<unsigned> cells; // sphere list of cell c in refs[cells[c]] to refs[cells[c + 1]]
+  std::vector<unsigned> refs;
+  // cells overlapped by the bounding box of sphere i
+  void cell_range(unsigned i, int (&c0)[3], int (&c1)[3]) const;
+  int cell(const Vec3f &p, size_t k) const;
+
+public:
+  // center and radius of every sphere, filled by the caller before build
+  std::vector<Vec4f> spheres;
+
+  SphereGrid() { resolution[0] = resolution[1] = resolution[2] = 0; };
+  void build(unsigned threads);
+  bool empty() const { return cells.empty(); };
+
+  // The cells a ray crosses, in order. The caller tests their spheres itself, with
+  // the arithmetic of its own kernels, so that the grid finds the hits a scan would.
+  class Walk {
+    const SphereGrid &grid;
+    int c[3], step[3], end[3];
+    float t_next[3], t_delta[3]; // along each axis, distance to the next cell boundary and between two
+    bool started, inside;
+
+  public:
+    Walk(const SphereGrid &grid, const Vec3f &orig, const Vec3f &dir, float dist);
+    // the spheres of the next cell, in [first, last). false after the last cell, or as
+    // soon as the hit found at dist lies inside the cells already walked.
+    bool next(float dist, const unsigned *&first, const unsigned *&last);
+  };
+};
+
+#endif
@@ -0,0 +1,55 @@
+#include <cstdio>
+#include <algorithm>
+#include <SFML/Graphics.hpp>
+
+#include "heatmap.hh"
+
+void CostMap::resize(unsigned w, unsigned h)
+{
+    width = w;
+    height = h;
+    rays.assign(w * h, 0.f);
+    tests.assign(w * h, 0.f);
+    ns.assign(w * h, 0.f);
+}
+
+// black, blue, red, yellow, white as the cost grows from 0 to 1
+static void false_colour(float t, unsigned char *pixel)
+{
+    static const float ramp[5][3] = {{0, 0, 0}, {0, 0, 1}, {1, 0, 0}, {1, 1, 0}, {1, 1, 1}};
+    t = std::max(0.f, std::min(1.f, t)) * 4;
+    int i = std::min(3, int(t));
+    float f = t - i;
+    for (int k = 0; k < 3; k++)
+        pixel[k] = (unsigned char)(255 * (ramp[i][k] * (1 - f) + ramp[i + 1][k] * f));
+    pixel[3] = 255;
+}
+
+static bool save_heatmap(const std::vector<float> &values, unsigned w, unsigned h, const std::string &path)
+{
+    // scaled to the 99.5th percentile, a few outliers (page faults, preemption) would flatten the timings
+    std::vector<float> sorted(values);
+    std::nth_element(sorted.begin(), sorted.begin() + sorted.size() * 995 / 1000, sorted.end());
+    float max = sorted[sorted.size() * 995 / 1000];
+    std::vector<unsigned char> pixmap(4 * w * h);
+    for (size_t i = 0; i < values.size(); i++)
+        false_colour(max > 0 ? values[i] / max : 0, &pixmap[4 * i]);
+    sf::Image image;
+    image.create(w, h, pixmap.data());
+    if (!image.saveToFile(path + ".png"))
+        return false;
+
+    FILE *raw = fopen((path + ".raw").c_str(), "wb");
+    if (!raw)
+        return false;
+    size_t written = fwrite(values.data(), sizeof(float), values.size(), raw);
+    fclose(raw);
+    return written == values.size();
+}
+
+bool save_heatmaps(const CostMap &costs, const std::string &prefix)
+{
+    return save_heatmap(costs.rays, costs.width, costs.height, prefix + "_rays") &&
+           save_heatmap(costs.tests, costs.width, costs.height, prefix + "_tests") &&
+           save_heatmap(costs.ns, costs.width, costs.height, prefix + "_time");
+}
@@ -0,0 +1,26 @@
+#ifndef _HEATMAP_HH
+#define _HEATMAP_HH
+
+#include <vector>
+#include <string>
+
+// Work done by cast_ray, counted when a RayCounters is handed to it
+struct RayCounters {
+  unsigned long long rays;  // primary, secondary and shadow rays traced
+  unsigned long long tests; // ray-object intersection tests
+  unsigned long long shadow_lookups, shadow_hits; // occluder cache, see Tinyraytracer::occluded
+  RayCounters() : rays(0), tests(0), shadow_lookups(0), shadow_hits(0) {};
+};
+
+// Per-pixel cost of a frame
+struct CostMap {
+  unsigned width, height;
+  std::vector<float> rays, tests, ns;
+  void resize(unsigned w, unsigned h);
+};
+
+// Writes <prefix>_{rays,tests,time}.png as false colour images scaled to each
+// buffer's 99.5th percentile, and the raw native float32 buffers as <prefix>_*.raw
+bool save_heatmaps(const CostMap &costs, const std::string &prefix);
+
+#endif
@@ -0,0 +1,96 @@
+#include <cmath>
+#include <algorithm>
+
+#include "latency.hh"
+
+const char *latency_stage_names[STAGE_COUNT] = {"queue", "render", "reorder", "present", "total"};
+
+Histogram::Histogram() : n(0), sum(0.), max(0.)
+{
+    std::fill(buckets, buckets + HISTOGRAM_STEPS * HISTOGRAM_OCTAVES, 0ULL);
+}
+
+void Histogram::add(double seconds)
+{
+    double us = std::max(1., seconds * 1e6);
+    int i = std::min(HISTOGRAM_STEPS * HISTOGRAM_OCTAVES - 1, int(std::log2(us) * HISTOGRAM_STEPS));
+    buckets[i]++;
+    n++;
+    sum += seconds;
+    max = std::max(max, seconds);
+}
+
+double Histogram::percentile(double p) const
+{
+    unsigned long long rank = (unsigned long long)std::ceil(p * n), seen = 0;
+    for (int i = 0; i < HISTOGRAM_STEPS * HISTOGRAM_OCTAVES; i++)
+    {
+        seen += buckets[i];
+        if (seen >= rank && seen > 0)
+            return std::min(max, std::exp2(double(i + 1) / HISTOGRAM_STEPS) * 1e-6);
+    }
+    return max;
+}
+
+static double seconds(Timestamp from, Timestamp to)
+{
+    return std::chrono::duration<double>(to - from).count();
+}
+
+void LatencyStats::record(const FrameTimes &times)
+{
+    std::lock_guard<std::mutex> lock(mx);
+    current[STAGE_QUEUE].add(seconds(times.created, times.renderStart));
+    current[STAGE_RENDER].add(seconds(times.renderStart, times.renderEnd));
+    current[STAGE_REORDER].add(seconds(times.renderEnd, times.popped));
+    current[STAGE_PRESENT].add(seconds(times.popped, times.presented));
+    current[STAGE_TOTAL].add(seconds(times.created, times.presented));
+}
+
+void LatencyStats::rotate()
+{
+    std::lock_guard<std::mutex> lock(mx);
+    for (int s = 0; s < STAGE_COUNT; s++)
+    {
+        last[s] = current[s];
+        current[s] = Histogram();
+    }
+}
+
+Histogram LatencyStats::stage(LatencyStage s) const
+{
+    std::lock_guard<std::mutex> lock(mx);
+    return last[s];
+}
+
+void LatencyStats::print(std::ostream &out) const
+{
+    out << "latency ms (mean/p50/p95/max):";
+    for (int s = 0; s < STAGE_COUNT; s++)
+    {
+        Histogram h = stage(LatencyStage(s));
+        out << " " << latency_stage_names[s] << " " << h.mean() * 1e3 << "/" << h.percentile(.5) * 1e3
+            << "/" << h.percentile(.95) * 1e3 << "/" << h.maximum() * 1e3;
+    }
+    out << std::endl;
+}
+
+void LatencyStats::draw_overlay(sf::RenderWindow &window) const
+{
+    const float pixels_per_ms = 2.f, bar = 6.f;
+    const sf::Color colors[STAGE_COUNT] = {sf::Color(80, 160, 255), sf::Color(255, 160, 40), sf::Color(200, 80, 220),
+                                           sf::Color(80, 220, 120), sf::Color(255, 255, 255)};
+    for (int s = 0; s < STAGE_COUNT; s++)
+    {
+        Histogram h = stage(LatencyStage(s));
+        float y = 8.f + s * 2.5f * bar;
+        sf::RectangleShape p95(sf::Vector2f(h.percentile(.95) * 1e3 * pixels_per_ms, bar));
+        p95.setPosition(8.f, y);
+        p95.setFillColor(sf::Color(colors[s].r, colors[s].g, colors[s].b, 90));
+        window.draw(p95);
+        sf::RectangleShape p50(sf::Vector2f(h.percentile(.5) * 1e3 * pixels_per_ms, bar));
+        p50.setPosition(8.f, y);
+        p50.setFillColor(colors[s]);
+        window.draw(p50);
+    }
+}
@@ -0,0 +1,59 @@
+#ifndef _LATENCY_HH
+#define _LATENCY_HH
+
+#include <chrono>
+#include <mutex>
+#include <iostream>
+#include <SFML/Graphics.hpp>
+
+// histogram buckets per doubling of the duration, and number of doublings above 1us
+#define HISTOGRAM_STEPS 4
+#define HISTOGRAM_OCTAVES 24
+
+typedef std::chrono::steady_clock::time_point Timestamp;
+
+// Life of a frame, from the input that created it to the moment it is on screen
+struct FrameTimes {
+  Timestamp created;     // camera parameters queued
+  Timestamp renderStart; // picked by a worker
+  Timestamp renderEnd;   // pushed to the reorder queue
+  Timestamp popped;      // taken by the display thread
+  Timestamp presented;   // window.display() returned
+};
+
+enum LatencyStage { STAGE_QUEUE, STAGE_RENDER, STAGE_REORDER, STAGE_PRESENT, STAGE_TOTAL, STAGE_COUNT };
+
+// Log-linear histogram of durations, from 1us to several seconds
+class Histogram {
+  unsigned long long buckets[HISTOGRAM_STEPS * HISTOGRAM_OCTAVES];
+  unsigned long long n;
+  double sum, max;
+
+public:
+  Histogram();
+  void add(double seconds);
+  unsigned long long count() const { return n; };
+  double mean() const { return n ? sum / n : 0.; };
+  double maximum() const { return max; };
+  double percentile(double p) const; // upper bound of the bucket holding the p-th fraction
+};
+
+// Per-stage latency histograms of the displayed frames. Frames are collected
+// into a window which rotate() publishes, so that readers see complete periods.
+class LatencyStats {
+  Histogram current[STAGE_COUNT];
+  Histogram last[STAGE_COUNT];
+  mutable std::mutex mx;
+
+public:
+  void record(const FrameTimes &times);
+  void rotate();
+  Histogram stage(LatencyStage s) const; // from the last complete window
+  void print(std::ostream &out) const;
+  // p50 and p95 bars of every stage, on top of the frame
+  void draw_overlay(sf::RenderWindow &window) const;
+};
+
+extern const char *latency_stage_names[STAGE_COUNT];
+
+#endif
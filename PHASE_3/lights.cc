@@ -0,0 +1,66 @@
+#include <algorithm>
+
+#include "lights.hh"
+
+void LightTree::build(const std::vector<Light> &lights)
+{
+    bounded.clear();
+    unbounded.clear();
+    std::vector<Vec3f> min, max;
+    for (unsigned i = 0; i < lights.size(); i++)
+        if (lights[i].radius > 0)
+        {
+            const Vec3f r(lights[i].radius, lights[i].radius, lights[i].radius);
+            bounded.push_back(i);
+            min.push_back(lights[i].position - r);
+            max.push_back(lights[i].position + r);
+        }
+        else
+            unbounded.push_back(i);
+    bvh.build(min, max);
+}
+
+void LightTree::query(const std::vector<Light> &lights, const Vec3f &p, float cutoff, std::vector<LightSample> &out) const
+{
+    for (size_t i = 0; i < unbounded.size(); i++)
+        out.push_back(LightSample(unbounded[i], 1.f));
+    bvh.query(p, [&](unsigned item) {
+        const Light &l = lights[bounded[item]];
+        Vec3f d = l.position - p;
+        float falloff = light_falloff(l, d * d);
+        if (l.intensity * falloff >= cutoff)
+            out.push_back(LightSample(bounded[item], falloff));
+    });
+}
+
+// xorshift, enough to spread the draws of neighbouring points
+static uint32_t next_random(uint32_t &state)
+{
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return state;
+}
+
+void select_lights(const std::vector<Light> &lights, std::vector<LightSample> &samples, unsigned count, uint32_t seed)
+{
+    const size_t n = samples.size();
+    static thread_local std::vector<float> cdf;
+    cdf.resize(n);
+    float total = 0;
+    for (size_t i = 0; i < n; i++)
+        cdf[i] = total += lights[samples[i].light].intensity * samples[i].scale;
+    if (total <= 0)
+        return;
+
+    uint32_t state = seed | 1;
+    for (unsigned k = 0; k < count; k++)
+    {
+        float u = (next_random(state) >> 8) * (1.f / (1 << 24)) * total;
+        size_t i = std::min(n - 1, size_t(std::upper_bound(cdf.begin(), cdf.end(), u) - cdf.begin()));
+        // probability of i is its intensity over total, each of the count draws stands for 1/count of the sum
+        float weight = lights[samples[i].light].intensity * samples[i].scale;
+        samples.push_back(LightSample(samples[i].light, samples[i].scale * total / (weight * count)));
+    }
+    samples.erase(samples.begin(), samples.begin() + n);
+}
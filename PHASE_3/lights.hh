@@ -0,0 +1,52 @@
+#ifndef _LIGHTS_HH
+#define _LIGHTS_HH
+
+#include <vector>
+#include <stdint.h>
+
+#include "geometry.hh"
+#include "bvh.hh"
+
+// shading points whose share of a light falls under this intensity ignore it
+#define LIGHT_CUTOFF 0.01
+
+struct Light {
+  Vec3f position;
+  float intensity;
+  float radius; // of influence, 0 for a light reaching the whole scene without falloff
+  Light(const Vec3f &p, const float i, const float r = 0) :
+    position(p), intensity(i), radius(r) { };
+};
+
+// intensity factor of a light at squared distance d2, smoothly reaching 0 at its radius
+inline float light_falloff(const Light &l, float d2) {
+  if (l.radius <= 0) return 1.f;
+  float x = 1.f - d2 / (l.radius*l.radius);
+  return x > 0 ? x*x : 0.f;
+}
+
+// A light shading a point, its intensity scaled by scale
+struct LightSample {
+  unsigned light;
+  float scale;
+  LightSample(unsigned l, float s) : light(l), scale(s) {};
+};
+
+// Bounding volume hierarchy over the spheres of influence of the lights that
+// have a radius, the others reach every point and are kept aside
+class LightTree {
+  std::vector<unsigned> bounded, unbounded; // the tree items index bounded
+  Bvh bvh;
+
+public:
+  void build(const std::vector<Light> &lights);
+  // appends the lights reaching p above cutoff, with their falloff there
+  void query(const std::vector<Light> &lights, const Vec3f &p, float cutoff, std::vector<LightSample> &out) const;
+};
+
+// Keeps count samples drawn with replacement proportionally to the intensity
+// they bring, rescaled so that their sum still estimates the sum of all of them.
+// The draw only depends on seed, so that renders are reproducible.
+void select_lights(const std::vector<Light> &lights, std::vector<LightSample> &samples, unsigned count, uint32_t seed);
+
+#endif
@@ -1,10 +1,30 @@
 #include <iostream>
 #include <cstring>
+#include <cstdlib>
 #include <thread>
 #include <queue>
+#include <set>
+#include <algorithm>
+#include <memory>
+#include <deque>
 #include <mutex>
+#include <atomic>
 #include <vector>
+#include <chrono>
+#include <fstream>
+#include <string>
+#include <random>
+#include <cerrno>
+#include <sys/stat.h>
 #include "tinyraytracer.hh"
+#include "display.hh"
+#include "resolution.hh"
+#include "latency.hh"
+#include "metrics.hh"
+#include "trace.hh"
+#include "perfcounters.hh"
+#include "regress.hh"
+#include "dispatch.hh"
 /*
 #define WIDTH 1024
 #define HEIGHT 768
@@ -12,14 +32,18 @@
 #define WIDTH 512
 #define HEIGHT 384
 #define Q_MAX 15
+// no frame spared from cancellation
+#define NO_FRAME (~0ULL)
 
 struct ImgPriority
 {
-	sf::Image image;
-	int order;
+	unsigned char *pixels; // frame buffer borrowed from the pool
+	unsigned long long order;
+	unsigned width, height;
+	FrameTimes times;
 
-	ImgPriority(sf::Image image, int order)
-		: image(image), order(order)
+	ImgPriority(unsigned char *pixels, unsigned long long order, unsigned width, unsigned height, const FrameTimes &times)
+		: pixels(pixels), order(order), width(width), height(height), times(times)
 	{
 	}
 };
@@ -39,18 +63,55 @@ struct Angle
 	float logo;
 	float z_red;
 	float size_mirror;
+	unsigned width, height;
 	unsigned long long int frameNb;
+	unsigned long long int generation; // camera input the frame was queued after
+	FrameTimes times;
 };
 
-bool boolWindow = true;
-void compute(Tinyraytracer tinyraytracer);
-std::mutex mx;
+std::atomic<bool> boolWindow(true);
+void compute(Tinyraytracer tinyraytracer, unsigned id);
+void refine(Tinyraytracer tinyraytracer, unsigned id);
+InstrumentedMutex mx;
 std::priority_queue<ImgPriority, std::vector<ImgPriority>, cmpPriority> qImages;
-std::queue<Angle> qAngles;
+std::deque<Angle> qAngles;
+FramePool *framePool = nullptr;
+PipelineMetrics *metrics = nullptr;
+bool perfFrames = false; // hardware counters sampled around every frame
+// changes with every camera input, frames of an older generation are abandoned
+std::atomic<unsigned long long> viewGeneration(0);
+// numbers of the frames the workers are rendering
+std::set<unsigned long long> framesInFlight;
+// the frame in flight camera inputs leave to finish, NO_FRAME when there is none
+std::atomic<unsigned long long> sparedFrame(NO_FRAME);
+// progressive mode: view to refine
+Angle latestView;
+
+// value of a "-name=value" (or "--name=value") argument, nullptr if arg is another option
+static const char *option_value(const char *arg, const char *name)
+{
+	while (*arg == '-')
+		arg++;
+	size_t len = strlen(name);
+	if (strncmp(arg, name, len) || arg[len] != '=')
+		return nullptr;
+	return arg + len + 1;
+}
 
 int main(int argc, char *argv[])
 {
-	bool gui = false, animate = false;
+	bool gui = false, animate = false, progressive = false, latency = false, heatmap = false;
+	bool regress = false, regress_update = false, regress_time = false, fast_math = false, board = false, duck = false, wavefront = false;
+	bool shadow_cache = true, shapes = false, sphere_grid = false, compress_mesh = false;
+	unsigned max_depth = 0; // 0 keeps the default
+	BvhMethod bvh_method = BVH_SAH;
+	unsigned extra_lights = 0, light_samples = 0, signs = 0, particles = 0;
+	float target_fps = 0.; // 0 keeps the full resolution whatever the frame rate
+	const char *metrics_path = nullptr;
+	const char *trace_path = nullptr;
+	const char *treelets_path = nullptr;
+	unsigned treelet_budget = 256; // MB
+	Engine engine = ENGINE_FRAME_THREADS;
 
 	if (argc > 1)
 		for (int i = 1; i < argc; i++)
@@ -58,10 +119,68 @@ int main(int argc, char *argv[])
 			bool full = (!strcmp(argv[i], "-full"));
 			gui |= full | (!strcmp(argv[i], "-gui"));
 			animate |= full | (!strcmp(argv[i], "-animate"));
+			progressive |= !strcmp(argv[i], "-progressive");
+			latency |= !strcmp(argv[i], "-latency");
+			heatmap |= !strcmp(argv[i], "-heatmap");
+			perfFrames |= !strcmp(argv[i], "-perf");
+			regress |= !strcmp(argv[i], "-regress");
+			regress_update |= !strcmp(argv[i], "-regress-update");
+			regress_time |= !strcmp(argv[i], "-regress-time");
+			fast_math |= !strcmp(argv[i], "-fast-math");
+			board |= !strcmp(argv[i], "-board");
+			shapes |= !strcmp(argv[i], "-primitives");
+			duck |= !strcmp(argv[i], "-duck");
+			wavefront |= !strcmp(argv[i], "-wavefront");
+			shadow_cache &= !!strcmp(argv[i], "-no-shadow-cache");
+			sphere_grid |= !strcmp(argv[i], "-sphere-grid");
+			compress_mesh |= !strcmp(argv[i], "-compress-mesh");
+			if (const char *value = option_value(argv[i], "depth"))
+				max_depth = atoi(value);
+			if (const char *value = option_value(argv[i], "lights"))
+				extra_lights = atoi(value);
+			if (const char *value = option_value(argv[i], "light-samples"))
+				light_samples = atoi(value);
+			if (const char *value = option_value(argv[i], "quads"))
+				signs = atoi(value);
+			if (const char *value = option_value(argv[i], "spheres"))
+				particles = atoi(value);
+			if (const char *value = option_value(argv[i], "bvh"))
+				if (!parse_bvh_method(value, bvh_method))
+				{
+					std::cerr << "Error: unknown BVH builder " << value << ", expected median, sah or lbvh" << std::endl;
+					return -1;
+				}
+			if (const char *value = option_value(argv[i], "treelets"))
+				treelets_path = value;
+			if (const char *value = option_value(argv[i], "treelet-budget"))
+				treelet_budget = atoi(value);
+			if (const char *value = option_value(argv[i], "target-fps"))
+				target_fps = atof(value);
+			if (const char *value = option_value(argv[i], "metrics"))
+				metrics_path = value;
+			if (const char *value = option_value(argv[i], "trace"))
+				trace_path = value;
+			if (const char *value = option_value(argv[i], "engine"))
+				if (!parse_engine(value, engine))
+				{
+					std::cerr << "Error: unknown engine " << value << ", expected seq, omp, frame-threads or tiles" << std::endl;
+					return -1;
+				}
 		}
 
+	// the headless frame is rendered by workers and counted whole: its counters must exist
+	// before the scene is built, which starts the OpenMP threads
+	std::unique_ptr<PerfCounters> framePerf;
+	if (perfFrames && !gui)
+		framePerf.reset(new PerfCounters(true));
+
+	// the regression scenes use the environment map and the mesh committed with their goldens
+	const bool regression = regress || regress_update || regress_time;
+	const char *envmap_path = regression ? "golden/envmap.png" : "envmap.jpg";
+	const char *mesh_path = regression ? "golden/mesh.obj" : "duck.obj";
+
 	sf::Image background;
-	if (!background.loadFromFile("envmap.jpg"))
+	if (!background.loadFromFile(envmap_path))
 	{
 		std::cerr << "Error: can not load the environment map" << std::endl;
 		return -1;
@@ -90,18 +209,181 @@ int main(int argc, char *argv[])
 	tinyraytracer.add_light(Light(Vec3f(30, 50, -25), 1.8));
 	tinyraytracer.add_light(Light(Vec3f(30, 20, 30), 1.7));
 
+	// night scene: small lamps scattered around the spheres, each lighting its surroundings only
+	std::mt19937 rng(2022);
+	std::uniform_real_distribution<float> uniform(0, 1);
+	for (unsigned i = 0; i < extra_lights; i++)
+	{
+		Vec3f position(-12 + 24 * uniform(rng), -3 + 8 * uniform(rng), -30 + 24 * uniform(rng));
+		tinyraytracer.add_light(Light(position, 0.3 + 0.5 * uniform(rng), 6));
+	}
+	tinyraytracer.set_light_samples(light_samples);
+
+	// signage: small copies of the logo facing every direction, all sharing its texture
+	Material sign(1.0, Vec4f(1, 0, 0, 0), Vec3f(0.1, 0.1, 0.3), 10.);
+	for (unsigned i = 0; i < signs; i++)
+	{
+		Vec3f center(-15 + 30 * uniform(rng), -3 + 12 * uniform(rng), -45 + 25 * uniform(rng));
+		float yaw = 2 * M_PI * uniform(rng), scale = 0.05 + 0.15 * uniform(rng);
+		tinyraytracer.add_quad(center, Vec3f(cos(yaw), 0, sin(yaw)), Vec3f(sin(yaw), 0, -cos(yaw)),
+							   logo.getSize().x * scale / LOGO_DPI, logo.getSize().y * scale / LOGO_DPI, 0, sign);
+	}
+
+	// particles: a cloud of small spheres swirling between the others
+	for (unsigned i = 0; i < particles; i++)
+	{
+		Vec3f center(-12 + 24 * uniform(rng), -4 + 12 * uniform(rng), -32 + 20 * uniform(rng));
+		float radius = 0.02 + 0.08 * uniform(rng);
+		tinyraytracer.add_particle(Sphere(center, radius, i % 2 ? ivory : red_rubber), Vec3f(0, 0, -20));
+	}
+	tinyraytracer.set_sphere_grid(sphere_grid);
+
+	if (board)
+		tinyraytracer.add_board();
+	if (shapes)
+	{
+		tinyraytracer.add_box(Vec3f(-4.5, -4, -17.5), Vec3f(-1.5, -2, -14.5), ivory); // pedestal of the ivory sphere
+		tinyraytracer.add_cylinder(Vec3f(5, -4, -12), Vec3f(0, 3, 0), 1, red_rubber);
+		tinyraytracer.add_disc(Vec3f(-9, 2, -20), Vec3f(1, 0, 1), 2.5, mirror);
+	}
+	std::shared_ptr<const Model> treelet_model; // reports its paging once rendered
+	if (duck)
+	{
+		// the treelets of an earlier run are mapped as they are, without reading duck.obj.
+		// Only a missing file is made from duck.obj: any other file there is never overwritten.
+		std::shared_ptr<Model> model(new Model(std::vector<Vec3f>(), std::vector<Vec3i>()));
+		struct stat treelets_stat;
+		bool treelets_missing = treelets_path && stat(treelets_path, &treelets_stat) && errno == ENOENT;
+		if (treelets_path && !treelets_missing && !model->map_treelets(treelets_path, size_t(treelet_budget) << 20))
+		{
+			std::cerr << "Error: can not map the treelets of " << treelets_path << std::endl;
+			return -1;
+		}
+		if (!treelets_path || treelets_missing)
+		{
+			model.reset(new Model(mesh_path));
+			if (!model->nfaces())
+			{
+				std::cerr << "Error: can not load " << mesh_path << std::endl;
+				return -1;
+			}
+			model->build_bvh(bvh_method, std::thread::hardware_concurrency());
+			std::cerr << "bvh " << bvh_method_name(bvh_method) << ": " << model->bvh_stats() << std::endl;
+			if (treelets_path)
+			{
+				if (!model->save_treelets(treelets_path))
+				{
+					std::cerr << "Error: can not write the treelets to " << treelets_path << std::endl;
+					return -1;
+				}
+				model.reset(new Model(std::vector<Vec3f>(), std::vector<Vec3i>()));
+				if (!model->map_treelets(treelets_path, size_t(treelet_budget) << 20))
+				{
+					std::cerr << "Error: can not map the treelets of " << treelets_path << std::endl;
+					return -1;
+				}
+			}
+			else if (compress_mesh)
+			{
+				size_t bytes = model->bytes();
+				model->compress();
+				std::cerr << "compressed mesh: " << bytes << " to " << model->bytes() << " bytes" << std::endl;
+			}
+		}
+		if (treelets_path)
+			treelet_model = model;
+		tinyraytracer.add_mesh(Mesh(model, red_rubber));
+	}
+	if (max_depth && !tinyraytracer.set_max_depth(max_depth))
+	{
+		std::cerr << "Error: no render kernel for depth " << max_depth << ", expected 1, 2, 4 or 8" << std::endl;
+		return -1;
+	}
+	tinyraytracer.set_engine(engine, std::thread::hardware_concurrency());
+	tinyraytracer.set_fast_math(fast_math);
+	tinyraytracer.set_wavefront(wavefront);
+	tinyraytracer.set_shadow_cache(shadow_cache);
+
+	if (progressive && animate)
+	{
+		std::cerr << "Progressive refinement needs a still scene, animation disabled" << std::endl;
+		animate = false;
+	}
+
+	if (regression)
+	{
+		// goldens of scenes built with other options are kept apart, e.g. default_board_mesh.png
+		std::string variant;
+		if (board)
+			variant += "_board";
+		if (shapes)
+			variant += "_primitives";
+		if (duck)
+			variant += "_mesh";
+		// quantized vertices move the silhouettes, the treelets hold the same compressed mesh
+		if (duck && (compress_mesh || treelets_path))
+			variant += "_compressed";
+		if (extra_lights)
+			variant += "_lights" + std::to_string(extra_lights);
+		if (light_samples)
+			variant += "_samples" + std::to_string(light_samples);
+		if (signs)
+			variant += "_quads" + std::to_string(signs);
+		if (particles)
+			variant += "_spheres" + std::to_string(particles);
+		if (max_depth)
+			variant += "_depth" + std::to_string(max_depth);
+		// timings are recorded per set of options, e.g. default_board_engine=tiles_fast-math.time
+		std::string options;
+		for (int i = 1; i < argc; i++)
+			if (strcmp(argv[i], "-regress") && strcmp(argv[i], "-regress-update") && strcmp(argv[i], "-regress-time"))
+			{
+				std::string arg = argv[i];
+				arg.erase(0, arg.find_first_not_of('-'));
+				std::replace(arg.begin(), arg.end(), '/', '_');
+				options += "_" + arg;
+			}
+		RegressMode mode = regress_update ? REGRESS_UPDATE : regress_time ? REGRESS_TIME : REGRESS_CHECK;
+		return run_regression(tinyraytracer, "golden", variant, options, mode) ? 1 : 0;
+	}
+
+	if (perfFrames)
+		std::cout << "kernels " << kernel_isa() << std::endl;
+
+	if (trace_path)
+	{
+		trace::start();
+		trace::name_thread("main");
+	}
+
 	if (gui)
 	{
+		// every queued angle, rendered image and in-flight frame holds at most one buffer
+		FramePool pool(WIDTH, HEIGHT, Q_MAX + std::thread::hardware_concurrency() + 1);
+		framePool = &pool;
+
+		// frame-threads renders one frame per worker, the other engines spread each frame over the cores
+		unsigned nWorkers = progressive || engine != ENGINE_FRAME_THREADS ? 1 : std::max(2u, std::thread::hardware_concurrency()) - 1;
+		PipelineMetrics pipelineMetrics(nWorkers);
+		metrics = &pipelineMetrics;
+		std::ofstream metricsFile;
+		if (metrics_path)
+			metricsFile.open(metrics_path);
+
 		std::vector<std::thread> vThreads;
-		for (size_t i = 0; i < (std::thread::hardware_concurrency() - 1); i++)
-			vThreads.push_back(std::thread(compute, tinyraytracer));
-		uint64_t frameCounter = 0;
+		for (unsigned i = 0; i < nWorkers; i++)
+			vThreads.push_back(std::thread(progressive ? refine : compute, tinyraytracer, i));
+		uint64_t frameCounter = 0, nextFrame = 0;
+		uint64_t inputFrame = 0; // first frame queued since the latest camera input
 		float fps = 30.;
 
 		sf::RenderWindow window(sf::VideoMode(WIDTH, HEIGHT), "TinyRT");
-		sf::Image result;
-		sf::Texture texture;
-		sf::Sprite sprite;
+		Display display(window, WIDTH, HEIGHT);
+		ResolutionController resolution(WIDTH, HEIGHT, target_fps > 0 ? target_fps : 30.,
+										vThreads.size());
+		LatencyStats latencyStats;
+		if (latency)
+			display.set_overlay(&latencyStats);
 		float angle_h = 0., angle_v = 0., z_red = -0.5, size_mirror = 3.;
 		float angle_logo = 15.;
 		bool up = true, big = true;
@@ -112,16 +394,25 @@ int main(int argc, char *argv[])
 		window.clear();
 		window.display();
 
-		sf::Image img = tinyraytracer.render(angle_v, angle_h, angle_logo, z_red, size_mirror);
-		texture.loadFromImage(img);
-		sprite.setTexture(texture);
-		window.draw(sprite);
-		window.display();
+		unsigned char *first = pool.acquire();
+		tinyraytracer.render(first, angle_v, angle_h, angle_logo, z_red, size_mirror);
+		display.present(first, WIDTH, HEIGHT);
+		pool.release(first);
+
+		mx.lock();
+		latestView.v = angle_v;
+		latestView.h = angle_h;
+		latestView.logo = angle_logo;
+		latestView.z_red = z_red;
+		latestView.size_mirror = size_mirror;
+		latestView.times.created = std::chrono::steady_clock::now();
+		viewGeneration++;
+		mx.unlock();
 
 		while (window.isOpen())
 		{
 			sf::Event event;
-			bool update = false, cond = false;
+			bool update = false, input = false, cond = false;
 			if (animate)
 			{
 				mx.lock();
@@ -166,124 +457,314 @@ int main(int argc, char *argv[])
 					if (event.key.code == sf::Keyboard::Left)
 					{
 						angle_h += angle_h >= 359. ? -359. : 1.;
-						update = true;
+						update = input = true;
 						std::cerr << "Key pressed: "
 								  << "Left" << std::endl;
 					}
 					else if (event.key.code == sf::Keyboard::Right)
 					{
 						angle_h -= angle_h < 1. ? -359 : 1.;
-						update = true;
+						update = input = true;
 						std::cerr << "Key pressed: "
 								  << "Right" << std::endl;
 					}
 					else if (event.key.code == sf::Keyboard::Up)
 					{
 						angle_v += angle_v >= 359. ? -359. : 1.;
-						update = true;
+						update = input = true;
 						std::cerr << "Key pressed: "
 								  << "Up" << std::endl;
 					}
 					else if (event.key.code == sf::Keyboard::Down)
 					{
 						angle_v -= angle_v < 1. ? -359 : 1.;
-						update = true;
+						update = input = true;
 						std::cerr << "Key pressed: "
 								  << "Down" << std::endl;
 					}
 					else if (event.key.code == sf::Keyboard::Space)
 						std::cerr << "Key pressed: "
 								  << "Space" << std::endl;
+					else if (event.key.code == sf::Keyboard::L)
+						display.set_overlay(display.get_overlay() ? nullptr : &latencyStats);
 					else if (event.key.code == sf::Keyboard::Q)
-					{
-						for (size_t i = 0; i < std::thread::hardware_concurrency() - 1; i++)
-							vThreads.at(i).join();
 						window.close();
-						mx.lock();
-						boolWindow = false;
-						mx.unlock();
-					}
 					else
 						std::cerr << "Key pressed: "
 								  << "Unknown" << std::endl;
 				}
 				if (event.type == sf::Event::Closed)
-				{
-					mx.lock();
-					boolWindow = false;
-					mx.unlock();
-
 					window.close();
-				}
 			}
 			if (update)
 			{
-				static unsigned framecount = 0;
 				Angle angle;
 				angle.v = angle_v;
 				angle.h = angle_h;
 				angle.logo = angle_logo;
 				angle.z_red = z_red;
 				angle.size_mirror = size_mirror;
+				angle.width = target_fps > 0 ? resolution.width() : WIDTH;
+				angle.height = target_fps > 0 ? resolution.height() : HEIGHT;
 				angle.frameNb = frameCounter;
+				angle.times.created = std::chrono::steady_clock::now();
 
 				mx.lock();
-				qAngles.push(angle);
+				if (progressive)
+				{
+					latestView = angle;
+					viewGeneration++;
+				}
+				else
+				{
+					if (input)
+					{
+						// every frame queued or in flight shows an outdated camera. The newest one in
+						// flight is left to finish, and stays spared until it has, so that inputs coming
+						// faster than frames render still show some; frames done are shown as well
+						if (sparedFrame == NO_FRAME && !framesInFlight.empty())
+							sparedFrame = *framesInFlight.rbegin();
+						viewGeneration++;
+						qAngles.clear();
+						inputFrame = frameCounter;
+					}
+					angle.generation = viewGeneration;
+					qAngles.push_back(angle);
+				}
 				frameCounter++;
-				cond = (!qImages.empty() && qImages.size() > 10);
 				mx.unlock();
-				if (cond)
+			}
+			if (progressive)
+			{
+				// only the most refined pass available is worth showing
+				mx.lock();
+				while (qImages.size() > 1)
 				{
-					mx.lock();
-					ImgPriority ip = qImages.top();
+					pool.release(qImages.top().pixels);
+					qImages.pop();
+				}
+				cond = !qImages.empty();
+				pipelineMetrics.sample_queues(0, qImages.size());
+				mx.unlock();
+			}
+			else
+			{
+				mx.lock();
+				pipelineMetrics.sample_queues(qAngles.size(), qImages.size());
+				// the frames queued since the latest input are shown in order. Of those queued before,
+				// cancelled or spared, only the newest done is worth showing, and only until a newer
+				// one is; frames older than the one shown may still be handed back by workers
+				while (!qImages.empty() && (qImages.top().order < nextFrame ||
+											(qImages.top().order < inputFrame && qImages.size() > 1)))
+				{
+					pool.release(qImages.top().pixels);
 					qImages.pop();
-					mx.unlock();
-
-					texture.loadFromImage(ip.image);
-					window.clear();
-					window.draw(sprite);
-					window.display();
-					framecount++;
-					sf::Time currentTime = clock.getElapsedTime();
-					if (currentTime.asSeconds() > 1.0)
-					{
-						fps = framecount / currentTime.asSeconds();
-						std::cout << "fps: " << fps << std::endl;
-						clock.restart();
-						framecount = 0;
-					}
+				}
+				if (!qImages.empty() && qImages.top().order >= inputFrame)
+					nextFrame = std::max(nextFrame, inputFrame);
+				cond = !qImages.empty() && (qImages.top().order < inputFrame || qImages.top().order == nextFrame);
+				mx.unlock();
+			}
+			if (cond)
+			{
+				static unsigned framecount = 0;
+				mx.lock();
+				ImgPriority ip = qImages.top();
+				{
+					TRACE_SCOPE("queue pop");
+					qImages.pop();
+				}
+				mx.unlock();
+				ip.times.popped = std::chrono::steady_clock::now();
+
+				std::chrono::duration<float> renderTime = ip.times.renderEnd - ip.times.renderStart;
+				resolution.frame_done(renderTime.count(), ip.width, ip.height);
+				display.present(ip.pixels, ip.width, ip.height);
+				pool.release(ip.pixels);
+				ip.times.presented = std::chrono::steady_clock::now();
+				latencyStats.record(ip.times);
+				nextFrame = ip.order + 1;
+				framecount++;
+				sf::Time currentTime = clock.getElapsedTime();
+				if (currentTime.asSeconds() > 1.0)
+				{
+					fps = framecount / currentTime.asSeconds();
+					std::cout << "fps: " << fps << std::endl;
+					latencyStats.rotate();
+					if (latency)
+						latencyStats.print(std::cout);
+					if (metricsFile.is_open())
+						pipelineMetrics.export_json(metricsFile, mx);
+					clock.restart();
+					framecount = 0;
 				}
 			}
 		}
+
+		boolWindow = false;
+		for (size_t i = 0; i < vThreads.size(); i++)
+			vThreads.at(i).join();
 	}
 	else
 	{
-		sf::Image result = tinyraytracer.render(0, 0, 15, -0.5, 4);
+		sf::Image result;
+		{
+			TRACE_SCOPE("frame render");
+			RayCounters counters;
+			std::vector<unsigned char> pixmap(4 * WIDTH * HEIGHT);
+			if (framePerf)
+				framePerf->start();
+			tinyraytracer.render(pixmap.data(), 0, 0, 15, -0.5, 4, CancelToken(), framePerf ? &counters : nullptr);
+			if (framePerf)
+				print_perf(std::cout, "out.jpg", framePerf->stop(), counters);
+			result.create(WIDTH, HEIGHT, pixmap.data());
+		}
+		TRACE_SCOPE("encode");
 		result.saveToFile("out.jpg");
+
+		if (heatmap)
+		{
+			std::vector<unsigned char> pixmap(4 * WIDTH * HEIGHT);
+			CostMap costs;
+			tinyraytracer.render_costs(pixmap.data(), costs, 0, 0, 15, -0.5, 4);
+			if (!save_heatmaps(costs, "heat"))
+				std::cerr << "Error: can not write the heatmaps" << std::endl;
+		}
 	}
+	if (trace_path && !trace::write(trace_path))
+		std::cerr << "Error: can not write the trace to " << trace_path << std::endl;
+	if (treelet_model)
+		std::cerr << "treelets: " << treelet_model->treelet_stats() << std::endl;
 	return 0;
 }
 
-void compute(Tinyraytracer tinyraytracer)
+void compute(Tinyraytracer tinyraytracer, unsigned id)
 {
 	bool cond = false;
+	WorkerStats &stats = metrics->worker(id);
+	Timestamp since = std::chrono::steady_clock::now();
+	trace::name_thread("compute");
+	PerfCounters perf(true); // counts this worker and the threads its engine renders with
 	while (boolWindow)
 	{
+		Angle next = Angle();
 		mx.lock();
 		cond = !qAngles.empty();
-		mx.unlock();
 		if (cond)
 		{
+			TRACE_SCOPE("queue pop");
+			// in order: camera inputs clear the queue, every frame queued is shown
+			next = qAngles.front();
+			qAngles.pop_front();
+			framesInFlight.insert(next.frameNb);
+		}
+		mx.unlock();
+		if (!cond)
+			stats.account(WORKER_SPIN, since);
+		else
+		{
+			unsigned char *frame;
+			while (!(frame = framePool->acquire()) && boolWindow)
+				std::this_thread::yield();
+			stats.account(WORKER_IDLE, since);
+			if (!frame)
+				break;
+
+			next.times.renderStart = std::chrono::steady_clock::now();
+			tinyraytracer.set_size(next.width, next.height);
+			bool done;
+			RayCounters counters;
+			if (perfFrames)
+				perf.start();
+			{
+				TRACE_SCOPE("frame render");
+				done = tinyraytracer.render(frame, next.v, next.h, next.logo, next.z_red, next.size_mirror,
+											CancelToken(viewGeneration, next.generation, sparedFrame, next.frameNb),
+											perfFrames ? &counters : nullptr);
+			}
+			if (perfFrames && done)
+			{
+				std::string label = "frame " + std::to_string(next.frameNb) + " worker " + std::to_string(id);
+				print_perf(std::cout, label.c_str(), perf.stop(), counters);
+			}
+			next.times.renderEnd = std::chrono::steady_clock::now();
+			stats.account(WORKER_BUSY, since);
 			mx.lock();
-			Angle next = qAngles.front();
-			qAngles.pop();
+			// out of flight and queued at once, so that a camera input sees the frame in either
+			framesInFlight.erase(next.frameNb);
+			if (sparedFrame == next.frameNb)
+				sparedFrame = NO_FRAME;
+			if (done)
+			{
+				TRACE_SCOPE("queue push");
+				qImages.push(ImgPriority(frame, next.frameNb, next.width, next.height, next.times));
+			}
 			mx.unlock();
+			// otherwise a newer camera input arrived, the worker is free for the newest frames
+			if (!done)
+				framePool->release(frame);
+		}
+	}
+}
 
-			sf::Image result = tinyraytracer.render(next.v, next.h, next.logo, next.z_red, next.size_mirror);
-			ImgPriority ip = ImgPriority(result, next.frameNb);
+// Progressive mode: renders the latest view pass after pass, using every core
+// through OpenMP, and starts over from a coarse pass as soon as the view changes.
+void refine(Tinyraytracer tinyraytracer, unsigned id)
+{
+	WorkerStats &stats = metrics->worker(id);
+	Timestamp since = std::chrono::steady_clock::now();
+	trace::name_thread("refine");
+	std::vector<Vec3f> accum;
+	unsigned long long generation = ~0ULL;
+	unsigned pass = 0;
+	int order = 0;
+	Angle view = Angle();
+	while (boolWindow)
+	{
+		if (viewGeneration != generation)
+		{
+			mx.lock();
+			generation = viewGeneration;
+			view = latestView;
+			mx.unlock();
+			pass = 0;
+		}
+		if (pass >= PROGRESSIVE_PASSES)
+		{
+			// the picture is complete, wait for the next camera move
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			stats.account(WORKER_IDLE, since);
+			continue;
+		}
+
+		unsigned char *frame;
+		while (!(frame = framePool->acquire()) && boolWindow)
+			std::this_thread::yield();
+		stats.account(WORKER_IDLE, since);
+		if (!frame)
+			break;
+
+		FrameTimes times = view.times;
+		times.renderStart = std::chrono::steady_clock::now();
+		bool done;
+		{
+			TRACE_SCOPE("frame render");
+			done = tinyraytracer.render_pass(frame, accum, pass, CancelToken(viewGeneration, generation),
+											 view.v, view.h, view.logo, view.z_red, view.size_mirror);
+		}
+		if (done)
+		{
+			times.renderEnd = std::chrono::steady_clock::now();
 			mx.lock();
-			qImages.push(ip);
+			{
+				TRACE_SCOPE("queue push");
+				qImages.push(ImgPriority(frame, order++, WIDTH, HEIGHT, times));
+			}
 			mx.unlock();
+			pass++;
 		}
+		else
+			framePool->release(frame);
+		stats.account(WORKER_BUSY, since);
 	}
-}
\ No newline at end of file
+}
@@ -0,0 +1,97 @@
+#include <algorithm>
+
+#include "metrics.hh"
+
+static unsigned long long elapsed_ns(Timestamp from, Timestamp to)
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(to - from).count();
+}
+
+void InstrumentedMutex::lock()
+{
+    if (!m.try_lock())
+    {
+        Timestamp start = std::chrono::steady_clock::now();
+        m.lock();
+        acquired = std::chrono::steady_clock::now();
+        contended++;
+        wait_ns += elapsed_ns(start, acquired);
+    }
+    else
+        acquired = std::chrono::steady_clock::now();
+    acquisitions++;
+}
+
+void InstrumentedMutex::unlock()
+{
+    hold_ns += elapsed_ns(acquired, std::chrono::steady_clock::now());
+    m.unlock();
+}
+
+InstrumentedMutex::Counters InstrumentedMutex::counters()
+{
+    std::lock_guard<std::mutex> lock(m);
+    Counters c = {acquisitions, contended, wait_ns, hold_ns};
+    return c;
+}
+
+void WorkerStats::account(WorkerState state, Timestamp &since)
+{
+    Timestamp now = std::chrono::steady_clock::now();
+    ns[state].fetch_add(elapsed_ns(since, now), std::memory_order_relaxed);
+    since = now;
+}
+
+PipelineMetrics::PipelineMetrics(unsigned n_workers)
+    : workers(n_workers), last_ns(n_workers * WORKER_STATES, 0), last_lock(),
+      last_export(std::chrono::steady_clock::now()), samples(0), angles_sum(0), images_sum(0),
+      angles_max(0), images_max(0), angles_last(0), images_last(0)
+{
+}
+
+void PipelineMetrics::sample_queues(size_t angles, size_t images)
+{
+    samples++;
+    angles_sum += angles;
+    images_sum += images;
+    angles_max = std::max(angles_max, angles);
+    images_max = std::max(images_max, images);
+    angles_last = angles;
+    images_last = images;
+}
+
+void PipelineMetrics::export_json(std::ostream &out, InstrumentedMutex &mx)
+{
+    Timestamp now = std::chrono::steady_clock::now();
+    double period = std::max(1ULL, elapsed_ns(last_export, now));
+    InstrumentedMutex::Counters lock = mx.counters();
+
+    out << "{\"period_ms\":" << period * 1e-6
+        << ",\"queue_angles\":{\"mean\":" << (samples ? double(angles_sum) / samples : 0.)
+        << ",\"max\":" << angles_max << ",\"last\":" << angles_last << "}"
+        << ",\"queue_images\":{\"mean\":" << (samples ? double(images_sum) / samples : 0.)
+        << ",\"max\":" << images_max << ",\"last\":" << images_last << "}"
+        << ",\"lock\":{\"acquisitions\":" << lock.acquisitions - last_lock.acquisitions
+        << ",\"contended\":" << lock.contended - last_lock.contended
+        << ",\"wait_ms\":" << (lock.wait_ns - last_lock.wait_ns) * 1e-6
+        << ",\"hold_ms\":" << (lock.hold_ns - last_lock.hold_ns) * 1e-6 << "}"
+        << ",\"workers\":[";
+    for (size_t w = 0; w < workers.size(); w++)
+    {
+        out << (w ? "," : "") << "{";
+        for (int s = 0; s < WORKER_STATES; s++)
+        {
+            static const char *names[WORKER_STATES] = {"busy", "idle", "spin"};
+            unsigned long long ns = workers[w].ns[s].load(std::memory_order_relaxed);
+            out << (s ? "," : "") << "\"" << names[s] << "\":" << (ns - last_ns[w * WORKER_STATES + s]) / period;
+            last_ns[w * WORKER_STATES + s] = ns;
+        }
+        out << "}";
+    }
+    out << "]}" << std::endl;
+
+    last_lock = lock;
+    last_export = now;
+    samples = angles_sum = images_sum = 0;
+    angles_max = images_max = 0;
+}
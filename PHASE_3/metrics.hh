@@ -0,0 +1,58 @@
+#ifndef _METRICS_HH
+#define _METRICS_HH
+
+#include <mutex>
+#include <atomic>
+#include <vector>
+#include <iostream>
+
+#include "latency.hh"
+
+// Mutex recording how often it is taken, how long threads wait for it and how
+// long it is held. Usable with std::lock_guard like a std::mutex.
+class InstrumentedMutex {
+  std::mutex m;
+  Timestamp acquired;
+  // only updated while holding m
+  unsigned long long acquisitions, contended, wait_ns, hold_ns;
+
+public:
+  struct Counters {
+    unsigned long long acquisitions, contended, wait_ns, hold_ns;
+  };
+  InstrumentedMutex() : acquisitions(0), contended(0), wait_ns(0), hold_ns(0) {};
+  void lock();
+  void unlock();
+  Counters counters();
+};
+
+enum WorkerState { WORKER_BUSY, WORKER_IDLE, WORKER_SPIN, WORKER_STATES };
+
+// Time a worker spent rendering (busy), blocked for a frame buffer or with
+// nothing to refine (idle) and polling an empty queue (spin)
+struct WorkerStats {
+  std::atomic<unsigned long long> ns[WORKER_STATES];
+  WorkerStats() { for (int s = 0; s < WORKER_STATES; s++) ns[s] = 0; };
+  // charges the time elapsed since `since` to state and restarts the count
+  void account(WorkerState state, Timestamp &since);
+};
+
+// Queue depths, lock statistics and worker utilization of the GUI pipeline,
+// exported as one JSON object per line and per period
+class PipelineMetrics {
+  std::vector<WorkerStats> workers;
+  std::vector<unsigned long long> last_ns;
+  InstrumentedMutex::Counters last_lock;
+  Timestamp last_export;
+  unsigned long long samples, angles_sum, images_sum;
+  size_t angles_max, images_max, angles_last, images_last;
+
+public:
+  PipelineMetrics(unsigned n_workers);
+  WorkerStats &worker(unsigned id) { return workers[id]; };
+  // called by the display thread while it holds the queue lock
+  void sample_queues(size_t angles, size_t images);
+  void export_json(std::ostream &out, InstrumentedMutex &mx);
+};
+
+#endif
@@ -39,15 +39,18 @@ Model::Model(const char *filename) : verts(), faces() {
     get_bbox(min, max);
 }
 
+Model::Model(const std::vector<Vec3f> &verts, const std::vector<Vec3i> &faces) : verts(verts), faces(faces) {
+}
+
 // Moller and Trumbore
-bool Model::ray_triangle_intersect(const int &fi, const Vec3f &orig, const Vec3f &dir, float &tnear, Vec3f &N) {
-    Vec3f edge1 = point(vert(fi,1)) - point(vert(fi,0));
-    Vec3f edge2 = point(vert(fi,2)) - point(vert(fi,0));
+static inline bool triangle_intersect(const Vec3f &v0, const Vec3f &v1, const Vec3f &v2, const Vec3f &orig, const Vec3f &dir, float &tnear, Vec3f &N) {
+    Vec3f edge1 = v1 - v0;
+    Vec3f edge2 = v2 - v0;
     Vec3f pvec = cross(dir, edge2);
     float det = edge1*pvec;
     if (det<1e-5) return false;
 
-    Vec3f tvec = orig - point(vert(fi,0));
+    Vec3f tvec = orig - v0;
     float u = tvec*pvec;
     if (u < 0 || u > det) return false;
 
@@ -60,13 +63,118 @@ bool Model::ray_triangle_intersect(const int &fi, const Vec3f &orig, const Vec3f
     return tnear>1e-5;
 }
 
+bool Model::ray_triangle_intersect(const int &fi, const Vec3f &orig, const Vec3f &dir, float &tnear, Vec3f &N) const {
+    return triangle_intersect(point(vert(fi,0)), point(vert(fi,1)), point(vert(fi,2)), orig, dir, tnear, N);
+}
+
+bool Model::intersect(int face, const Vec3f &orig, const Vec3f &dir, float &tnear, Vec3f &N) const {
+    if (!treelets.empty()) {
+        Vec3f a, b, c;
+        return treelets.triangle(face, a, b, c) && triangle_intersect(a, b, c, orig, dir, tnear, N);
+    }
+    if (!compressed.empty()) {
+        Vec3f a, b, c;
+        return compressed.triangle(face, a, b, c) && triangle_intersect(a, b, c, orig, dir, tnear, N);
+    }
+    return face>=0 && face<nfaces() && ray_triangle_intersect(face, orig, dir, tnear, N);
+}
+
+bool Model::intersect(const Vec3f &orig, const Vec3f &dir, float &dist, int &face, Vec3f &N, size_t &tests) const {
+    bool found = false;
+    auto test = [&](unsigned fi, float &d) {
+        float t;
+        Vec3f n;
+        if (ray_triangle_intersect(fi, orig, dir, t, n) && t < d) {
+            d = t;
+            face = fi;
+            N = n;
+            found = true;
+        }
+    };
+    auto test_corners = [&](unsigned fi, const Vec3f &a, const Vec3f &b, const Vec3f &c, float &d) {
+        float t;
+        Vec3f n;
+        if (triangle_intersect(a, b, c, orig, dir, t, n) && t < d) {
+            d = t;
+            face = fi;
+            N = n;
+            found = true;
+        }
+    };
+    if (!treelets.empty())
+        tests += treelets.traverse(orig, dir, dist, test_corners);
+    else if (!compressed.empty())
+        tests += compressed.traverse(orig, dir, dist, test_corners);
+    else if (bvh.empty()) {
+        for (int fi=0; fi<nfaces(); fi++)
+            test(fi, dist);
+        tests += nfaces();
+    } else
+        tests += bvh.traverse(orig, dir, dist, test);
+    return found;
+}
+
+// the boxes are padded a little: a flat box could miss rays grazing its triangle
+void Model::build_bvh(BvhMethod method, unsigned threads) {
+    if (faces.empty()) return;
+    Vec3f lo, hi;
+    get_bbox(lo, hi);
+    float pad = 1e-5 * (hi - lo).norm();
+    std::vector<Vec3f> min(faces.size()), max(faces.size());
+    for (size_t fi=0; fi<faces.size(); fi++) {
+        min[fi] = max[fi] = verts[faces[fi][0]];
+        for (int li=1; li<3; li++)
+            for (int j=0; j<3; j++) {
+                min[fi][j] = std::min(min[fi][j], verts[faces[fi][li]][j]);
+                max[fi][j] = std::max(max[fi][j], verts[faces[fi][li]][j]);
+            }
+        for (int j=0; j<3; j++) {
+            min[fi][j] -= pad;
+            max[fi][j] += pad;
+        }
+    }
+    bvh.build(min, max, method, threads);
+}
+
+void Model::compress() {
+    if (faces.empty()) return;
+    if (bvh.empty())
+        build_bvh(BVH_SAH, 1);
+    Vec3f min, max;
+    get_bbox(min, max);
+    compressed.build(verts, faces, min, max, bvh);
+    std::vector<Vec3f>().swap(verts);
+    std::vector<Vec3i>().swap(faces);
+    bvh = Bvh();
+}
+
+size_t Model::bytes() const {
+    return verts.size()*sizeof(Vec3f) + faces.size()*sizeof(Vec3i) + bvh.bytes() + compressed.bytes() + treelets.bytes();
+}
+
+bool Model::save_treelets(const char *path) {
+    if (compressed.empty())
+        compress();
+    return TreeletMesh::write(path, compressed);
+}
+
+bool Model::map_treelets(const char *path, size_t budget) {
+    if (!treelets.open(path, budget))
+        return false;
+    std::vector<Vec3f>().swap(verts);
+    std::vector<Vec3i>().swap(faces);
+    bvh = Bvh();
+    compressed = CompressedMesh();
+    return true;
+}
 
 int Model::nverts() const {
     return (int)verts.size();
 }
 
 int Model::nfaces() const {
-    return (int)faces.size();
+    if (!treelets.empty()) return (int)treelets.triangles();
+    return compressed.empty() ? (int)faces.size() : (int)compressed.triangles();
 }
 
 void Model::get_bbox(Vec3f &min, Vec3f &max) {
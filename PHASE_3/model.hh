@@ -3,19 +3,42 @@
 #include <vector>
 #include <string>
 #include "geometry.hh"
+#include "bvh.hh"
+#include "cmesh.hh"
+#include "treelets.hh"
 
 class Model {
 private:
     std::vector<Vec3f> verts;
     std::vector<Vec3i> faces;
+    Bvh bvh; // over the faces, once built
+    CompressedMesh compressed; // replaces verts, faces and bvh once compress is called
+    TreeletMesh treelets;      // replaces all of them once map_treelets is called
 public:
     Model(const char *filename);
+    Model(const std::vector<Vec3f> &verts, const std::vector<Vec3i> &faces);
 
     int nverts() const;                          // number of vertices
     int nfaces() const;                          // number of triangles
 
-    bool ray_triangle_intersect(const int &fi, const Vec3f &orig, const Vec3f &dir, float &tnear, Vec3f &N);
+    bool ray_triangle_intersect(const int &fi, const Vec3f &orig, const Vec3f &dir, float &tnear, Vec3f &N) const;
+    // the same for a face intersect returned, false if there is no such face
+    bool intersect(int face, const Vec3f &orig, const Vec3f &dir, float &tnear, Vec3f &N) const;
+    // closest triangle hit before dist, which is then updated; every triangle is tested until build_bvh is called.
+    // tests counts the triangles tested.
+    bool intersect(const Vec3f &orig, const Vec3f &dir, float &dist, int &face, Vec3f &N, size_t &tests) const;
+    void build_bvh(BvhMethod method, unsigned threads);
+    BvhStats bvh_stats() const { return bvh.stats(); }
+    // quantizes the mesh and its tree (built first if need be), then frees the full precision ones
+    void compress();
+    size_t bytes() const;                        // memory taken by the mesh and its tree
+    // compresses the mesh and stores it as treelets in path, for map_treelets
+    bool save_treelets(const char *path);
+    // renders the treelets of path from the file, with budget bytes of them in memory
+    bool map_treelets(const char *path, size_t budget);
+    TreeletStats treelet_stats() const { return treelets.stats(); }
 
+    // until compress is called
     const Vec3f &point(int i) const;                   // coordinates of the vertex i
     Vec3f &point(int i);                   // coordinates of the vertex i
     int vert(int fi, int li) const;              // index of the vertex for the triangle fi and local index li
@@ -0,0 +1,120 @@
+#include <mutex>
+#include <cstring>
+
+#include "perfcounters.hh"
+
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+static int open_counter(unsigned type, unsigned long long config, bool threads)
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1; // allowed up to perf_event_paranoid == 2
+    attr.exclude_hv = 1;
+    attr.inherit = threads; // the kernel adds up the counts of the threads started since
+    // this thread, on whichever CPU it runs
+    return syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+PerfCounters::PerfCounters(bool threads)
+{
+    fd[PERF_CYCLES] = open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, threads);
+    fd[PERF_INSTRUCTIONS] = open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, threads);
+    fd[PERF_L1D_MISSES] = open_counter(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                                                               (PERF_COUNT_HW_CACHE_RESULT_MISS << 16), threads);
+    fd[PERF_LLC_MISSES] = open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, threads);
+    fd[PERF_BRANCH_MISSES] = open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES, threads);
+    fd[PERF_TASK_CLOCK] = open_counter(PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK, threads);
+}
+
+PerfCounters::~PerfCounters()
+{
+    for (int e = 0; e < PERF_EVENTS; e++)
+        if (fd[e] >= 0)
+            close(fd[e]);
+}
+
+void PerfCounters::start()
+{
+    for (int e = 0; e < PERF_EVENTS; e++)
+        if (fd[e] >= 0)
+        {
+            ioctl(fd[e], PERF_EVENT_IOC_RESET, 0);
+            ioctl(fd[e], PERF_EVENT_IOC_ENABLE, 0);
+        }
+}
+
+PerfSample PerfCounters::stop()
+{
+    PerfSample sample;
+    for (int e = 0; e < PERF_EVENTS; e++)
+    {
+        sample.value[e] = 0;
+        sample.valid[e] = fd[e] >= 0 && ioctl(fd[e], PERF_EVENT_IOC_DISABLE, 0) == 0 &&
+                          read(fd[e], &sample.value[e], sizeof(sample.value[e])) == sizeof(sample.value[e]);
+    }
+    return sample;
+}
+#else
+PerfCounters::PerfCounters(bool)
+{
+    for (int e = 0; e < PERF_EVENTS; e++)
+        fd[e] = -1;
+}
+
+PerfCounters::~PerfCounters() {}
+
+void PerfCounters::start() {}
+
+PerfSample PerfCounters::stop()
+{
+    PerfSample sample;
+    for (int e = 0; e < PERF_EVENTS; e++)
+    {
+        sample.value[e] = 0;
+        sample.valid[e] = false;
+    }
+    return sample;
+}
+#endif
+
+bool PerfCounters::available() const
+{
+    for (int e = 0; e < PERF_EVENTS; e++)
+        if (fd[e] >= 0)
+            return true;
+    return false;
+}
+
+void print_perf(std::ostream &out, const char *label, const PerfSample &sample, const RayCounters &counters)
+{
+    const unsigned long long rays = counters.rays;
+    static std::mutex print_mx; // lines of concurrent workers must not interleave
+    static const char *names[PERF_EVENTS] = {"cycles", "instructions", "L1D misses", "LLC misses", "branch misses", "ns"};
+    std::lock_guard<std::mutex> lock(print_mx);
+
+    out << "perf " << label << ": " << rays << " rays";
+    if (sample.valid[PERF_CYCLES] && sample.valid[PERF_INSTRUCTIONS] && sample.value[PERF_CYCLES])
+        out << ", IPC " << double(sample.value[PERF_INSTRUCTIONS]) / sample.value[PERF_CYCLES];
+    for (int e = 0; e < PERF_EVENTS; e++)
+    {
+        out << ", " << names[e] << "/ray ";
+        if (sample.valid[e] && rays)
+            out << double(sample.value[e]) / rays;
+        else
+            out << "n/a";
+    }
+    if (rays)
+        out << ", tests/ray " << double(counters.tests) / rays;
+    if (counters.shadow_lookups)
+        out << ", shadow cache hits " << 100. * counters.shadow_hits / counters.shadow_lookups << "%";
+    out << std::endl;
+}
@@ -0,0 +1,42 @@
+#ifndef _PERFCOUNTERS_HH
+#define _PERFCOUNTERS_HH
+
+#include <iostream>
+
+#include "heatmap.hh"
+
+enum PerfEvent {
+  PERF_CYCLES,
+  PERF_INSTRUCTIONS,
+  PERF_L1D_MISSES,
+  PERF_LLC_MISSES,
+  PERF_BRANCH_MISSES,
+  PERF_TASK_CLOCK, // software counter, in ns, available even where the PMU is not
+  PERF_EVENTS
+};
+
+struct PerfSample {
+  unsigned long long value[PERF_EVENTS];
+  bool valid[PERF_EVENTS];
+};
+
+// Hardware performance counters of the thread that created the object, read
+// through perf_event_open. Counters the kernel or the CPU refuses (VMs,
+// perf_event_paranoid > 2, other OSes) are reported as unavailable.
+class PerfCounters {
+  int fd[PERF_EVENTS];
+
+public:
+  // with threads, the threads started afterwards by this one are counted as well: the
+  // counters must then be created before the render workers or the OpenMP threads start
+  PerfCounters(bool threads = false);
+  ~PerfCounters();
+  bool available() const; // at least one counter could be opened
+  void start();
+  PerfSample stop();
+};
+
+// IPC and events per ray of one frame or benchmark run, and the shadow occluder cache hit rate
+void print_perf(std::ostream &out, const char *label, const PerfSample &sample, const RayCounters &counters);
+
+#endif
@@ -0,0 +1,471 @@
+#include <cmath>
+#include <limits>
+#include <algorithm>
+
+#include "primitives.hh"
+#include "bvh.hh"
+#include "dispatch.hh"
+
+// stands for no hit in the batches. Their loops must have no branch to
+// vectorize: every lane is computed, infinities and NaNs included, then the
+// conditions, combined with & rather than &&, select the hits.
+static const float NO_HIT = std::numeric_limits<float>::max();
+
+enum { X, Y, Z };
+// columns of the box, plane, disc and cylinder arrays
+enum { BOX_MIN = 0, BOX_MAX = 3 };
+enum { PLANE_ORIGIN = 0, PLANE_NORMAL = 3, PLANE_U = 6, PLANE_V = 9, PLANE_CHECKER = 12, PLANE_UNIT_U = 13, PLANE_UNIT_V = 16 };
+enum { DISC_CENTER = 0, DISC_NORMAL = 3, DISC_R2 = 6 };
+enum { CYLINDER_BASE = 0, CYLINDER_AXIS = 3, CYLINDER_HEIGHT = 6, CYLINDER_R2 = 7 };
+
+template <unsigned N>
+void Primitives::Columns<N>::push(const float (&values)[N], unsigned m, const float (&padding)[N])
+{
+    if (count % PRIMITIVE_BATCH == 0)
+    {
+        for (unsigned c = 0; c < N; c++)
+            column[c].insert(column[c].end(), PRIMITIVE_BATCH, padding[c]);
+        material.insert(material.end(), PRIMITIVE_BATCH, 0);
+    }
+    for (unsigned c = 0; c < N; c++)
+        column[c][count] = values[c];
+    material[count] = m;
+    count++;
+}
+
+unsigned Primitives::add_box(const Vec3f &min, const Vec3f &max, unsigned material)
+{
+    const float values[6] = {min.x, min.y, min.z, max.x, max.y, max.z};
+    // infinite slabs, the far side is never closer than NO_HIT
+    const float inf = std::numeric_limits<float>::infinity();
+    const float padding[6] = {inf, inf, inf, -inf, -inf, -inf};
+    boxes.push(values, material, padding);
+    return added(id(BOX, boxes.count - 1));
+}
+
+unsigned Primitives::add_plane(const Vec3f &origin, const Vec3f &u, const Vec3f &v, unsigned material, float checker)
+{
+    Vec3f n = cross(u, v).normalize();
+    Vec3f su = u * (1 / (u * u)), sv = v * (1 / (v * v));
+    Vec3f uu = Vec3f(u).normalize(), uv = Vec3f(v).normalize();
+    const float values[19] = {origin.x, origin.y, origin.z, n.x, n.y, n.z, su.x, su.y, su.z, sv.x, sv.y, sv.z, checker,
+                              uu.x, uu.y, uu.z, uv.x, uv.y, uv.z};
+    const float padding[19] = {0}; // no normal, parallel to every ray
+    planes.push(values, material, padding);
+    return added(id(PLANE, planes.count - 1));
+}
+
+unsigned Primitives::add_disc(const Vec3f &center, const Vec3f &normal, float radius, unsigned material)
+{
+    Vec3f n = Vec3f(normal).normalize();
+    const float values[7] = {center.x, center.y, center.z, n.x, n.y, n.z, radius * radius};
+    const float padding[7] = {0, 0, 0, 0, 0, 0, -1};
+    discs.push(values, material, padding);
+    return added(id(DISC, discs.count - 1));
+}
+
+unsigned Primitives::add_cylinder(const Vec3f &base, const Vec3f &axis, float radius, unsigned material)
+{
+    Vec3f a = Vec3f(axis).normalize();
+    const float values[8] = {base.x, base.y, base.z, a.x, a.y, a.z, axis.norm(), radius * radius};
+    const float padding[8] = {0, 0, 0, 0, 1, 0, -1, -1};
+    cylinders.push(values, material, padding);
+    return added(id(CYLINDER, cylinders.count - 1));
+}
+
+// grows the bounds of the set by those of the new primitive id
+unsigned Primitives::added(unsigned id)
+{
+    Vec3f lo, hi;
+    bounds(id, lo, hi);
+    for (size_t k = 0; k < 3; k++)
+    {
+        min[k] = std::min(min[k], lo[k]);
+        max[k] = std::max(max[k], hi[k]);
+    }
+    grown = true;
+    return id;
+}
+
+template <unsigned N>
+void Primitives::Columns<N>::permute(const std::vector<unsigned> &order)
+{
+    // the padding past the primitives stays in place
+    for (unsigned c = 0; c < N; c++)
+    {
+        std::vector<float> sorted(column[c]);
+        for (size_t i = 0; i < order.size(); i++)
+            sorted[i] = column[c][order[i]];
+        column[c].swap(sorted);
+    }
+    std::vector<unsigned> sorted(material);
+    for (size_t i = 0; i < order.size(); i++)
+        sorted[i] = material[order[i]];
+    material.swap(sorted);
+}
+
+size_t Primitives::count(Type type) const
+{
+    switch (type)
+    {
+    case BOX:
+        return boxes.count;
+    case PLANE:
+        return planes.count;
+    case DISC:
+        return discs.count;
+    default:
+        return cylinders.count;
+    }
+}
+
+// orders the primitives of type along a Morton curve of their centers
+template <unsigned N>
+void Primitives::sort(Type type, Columns<N> &columns)
+{
+    std::vector<Vec3f> lo(columns.count), hi(columns.count);
+    for (size_t i = 0; i < columns.count; i++)
+        bounds(id(type, i), lo[i], hi[i]);
+    std::vector<unsigned> order;
+    morton_order(lo, hi, order);
+    columns.permute(order);
+}
+
+void Primitives::update()
+{
+    if (!grown)
+        return;
+    sort(BOX, boxes);
+    sort(PLANE, planes);
+    sort(DISC, discs);
+    sort(CYLINDER, cylinders);
+
+    batches.clear();
+    batch_min.clear();
+    batch_max.clear();
+    for (unsigned type = 0; type < TYPES; type++)
+        for (size_t i = 0; i < count(Type(type)); i++)
+        {
+            const unsigned id = this->id(Type(type), i);
+            Vec3f lo, hi;
+            bounds(id, lo, hi);
+            if (i % PRIMITIVE_BATCH == 0)
+            {
+                batches.push_back(id);
+                batch_min.push_back(lo);
+                batch_max.push_back(hi);
+            }
+            for (size_t k = 0; k < 3; k++)
+            {
+                batch_min.back()[k] = std::min(batch_min.back()[k], lo[k]);
+                batch_max.back()[k] = std::max(batch_max.back()[k], hi[k]);
+            }
+        }
+    bvh.build(batch_min, batch_max);
+    grown = false;
+}
+
+// slab test, the far side counts when orig is inside the box
+inline void Primitives::box_batch(size_t base, const Vec3f &orig, const Vec3f &inv_dir, float *t) const
+{
+    const float *min[3], *max[3];
+    for (int k = 0; k < 3; k++)
+    {
+        min[k] = boxes.column[BOX_MIN + k].data() + base;
+        max[k] = boxes.column[BOX_MAX + k].data() + base;
+    }
+    for (unsigned i = 0; i < PRIMITIVE_BATCH; i++)
+    {
+        float x0 = (min[X][i] - orig.x) * inv_dir.x, x1 = (max[X][i] - orig.x) * inv_dir.x;
+        float y0 = (min[Y][i] - orig.y) * inv_dir.y, y1 = (max[Y][i] - orig.y) * inv_dir.y;
+        float z0 = (min[Z][i] - orig.z) * inv_dir.z, z1 = (max[Z][i] - orig.z) * inv_dir.z;
+        float near = std::max(std::max(std::min(x0, x1), std::min(y0, y1)), std::min(z0, z1));
+        float far = std::min(std::min(std::max(x0, x1), std::max(y0, y1)), std::max(z0, z1));
+        float hit = near > 0 ? near : far;
+        t[i] = (near <= far) & (hit > 0) ? hit : NO_HIT;
+    }
+}
+
+inline void Primitives::plane_batch(size_t base, const Vec3f &orig, const Vec3f &dir, float *t) const
+{
+    const float *c[PLANE_CHECKER];
+    for (int k = 0; k < PLANE_CHECKER; k++)
+        c[k] = planes.column[k].data() + base;
+    for (unsigned i = 0; i < PRIMITIVE_BATCH; i++)
+    {
+        float px = c[PLANE_ORIGIN + X][i] - orig.x, py = c[PLANE_ORIGIN + Y][i] - orig.y, pz = c[PLANE_ORIGIN + Z][i] - orig.z;
+        float dn = dir.x * c[PLANE_NORMAL + X][i] + dir.y * c[PLANE_NORMAL + Y][i] + dir.z * c[PLANE_NORMAL + Z][i];
+        float pn = px * c[PLANE_NORMAL + X][i] + py * c[PLANE_NORMAL + Y][i] + pz * c[PLANE_NORMAL + Z][i];
+        float d = pn / dn;
+        // hit relative to the origin, in units of the edges
+        float hx = dir.x * d - px, hy = dir.y * d - py, hz = dir.z * d - pz;
+        float a = hx * c[PLANE_U + X][i] + hy * c[PLANE_U + Y][i] + hz * c[PLANE_U + Z][i];
+        float b = hx * c[PLANE_V + X][i] + hy * c[PLANE_V + Y][i] + hz * c[PLANE_V + Z][i];
+        bool inside = (std::fabs(dn) > 1e-3f) & (a >= 0) & (a <= 1) & (b >= 0) & (b <= 1); // grazing rays miss
+        t[i] = inside & (d > 0) ? d : NO_HIT;
+    }
+}
+
+inline void Primitives::disc_batch(size_t base, const Vec3f &orig, const Vec3f &dir, float *t) const
+{
+    const float *c[7];
+    for (int k = 0; k < 7; k++)
+        c[k] = discs.column[k].data() + base;
+    for (unsigned i = 0; i < PRIMITIVE_BATCH; i++)
+    {
+        float px = c[DISC_CENTER + X][i] - orig.x, py = c[DISC_CENTER + Y][i] - orig.y, pz = c[DISC_CENTER + Z][i] - orig.z;
+        float dn = dir.x * c[DISC_NORMAL + X][i] + dir.y * c[DISC_NORMAL + Y][i] + dir.z * c[DISC_NORMAL + Z][i];
+        float pn = px * c[DISC_NORMAL + X][i] + py * c[DISC_NORMAL + Y][i] + pz * c[DISC_NORMAL + Z][i];
+        float d = pn / dn;
+        float hx = dir.x * d - px, hy = dir.y * d - py, hz = dir.z * d - pz;
+        bool inside = (std::fabs(dn) > 1e-6f) & (hx * hx + hy * hy + hz * hz <= c[DISC_R2][i]);
+        t[i] = inside & (d > 0) ? d : NO_HIT;
+    }
+}
+
+// side and both caps, the nearest positive hit wins. The padding, of negative
+// height and squared radius, fails both tests.
+inline void Primitives::cylinder_batch(size_t base, const Vec3f &orig, const Vec3f &dir, float *t) const
+{
+    const float *c[8];
+    for (int k = 0; k < 8; k++)
+        c[k] = cylinders.column[k].data() + base;
+    for (unsigned i = 0; i < PRIMITIVE_BATCH; i++)
+    {
+        float ax = c[CYLINDER_AXIS + X][i], ay = c[CYLINDER_AXIS + Y][i], az = c[CYLINDER_AXIS + Z][i];
+        float ox = orig.x - c[CYLINDER_BASE + X][i], oy = orig.y - c[CYLINDER_BASE + Y][i], oz = orig.z - c[CYLINDER_BASE + Z][i];
+        float height = c[CYLINDER_HEIGHT][i], r2 = c[CYLINDER_R2][i];
+        float da = dir.x * ax + dir.y * ay + dir.z * az, oa = ox * ax + oy * ay + oz * az;
+        // components orthogonal to the axis
+        float dx = dir.x - ax * da, dy = dir.y - ay * da, dz = dir.z - az * da;
+        float px = ox - ax * oa, py = oy - ay * oa, pz = oz - az * oa;
+        float qa = dx * dx + dy * dy + dz * dz, qb = dx * px + dy * py + dz * pz, qc = px * px + py * py + pz * pz - r2;
+        float delta = qb * qb - qa * qc;
+        float root = std::sqrt(std::max(delta, 0.f));
+        float inv_qa = 1 / qa;
+        float s0 = (-qb - root) * inv_qa, s1 = (-qb + root) * inv_qa;
+        float h0 = oa + s0 * da, h1 = oa + s1 * da; // along the axis
+        bool side = (qa > 1e-12f) & (delta >= 0);
+        float best = side & (s0 > 0) & (h0 >= 0) & (h0 <= height) ? s0 : NO_HIT;
+        best = side & (s1 > 0) & (h1 >= 0) & (h1 <= height) & (s1 < best) ? s1 : best;
+
+        float inv_da = 1 / da;
+        float b0 = -oa * inv_da, b1 = (height - oa) * inv_da; // caps
+        float x0 = px + dx * b0, y0 = py + dy * b0, z0 = pz + dz * b0;
+        float x1 = px + dx * b1, y1 = py + dy * b1, z1 = pz + dz * b1;
+        bool cap = std::fabs(da) > 1e-12f;
+        best = cap & (b0 > 0) & (x0 * x0 + y0 * y0 + z0 * z0 <= r2) & (b0 < best) ? b0 : best;
+        best = cap & (b1 > 0) & (x1 * x1 + y1 * y1 + z1 * z1 <= r2) & (b1 < best) ? b1 : best;
+        t[i] = best;
+    }
+}
+
+// closest hit among the primitives of batch b before dist, which is then updated. The
+// lanes are only searched for the hit when the batch has one.
+inline void Primitives::batch_intersect(unsigned b, const Vec3f &orig, const Vec3f &dir, const Vec3f &inv_dir, float &dist,
+                                 unsigned &id) const
+{
+    float t[PRIMITIVE_BATCH];
+    const Type type = this->type(batches[b]);
+    const size_t base = index(batches[b]);
+    switch (type)
+    {
+    case BOX:
+        box_batch(base, orig, inv_dir, t);
+        break;
+    case PLANE:
+        plane_batch(base, orig, dir, t);
+        break;
+    case DISC:
+        disc_batch(base, orig, dir, t);
+        break;
+    default:
+        cylinder_batch(base, orig, dir, t);
+    }
+    float closest = t[0];
+    for (unsigned i = 1; i < PRIMITIVE_BATCH; i++)
+        closest = std::min(closest, t[i]);
+    if (closest < dist)
+    {
+        unsigned i = 0;
+        while (t[i] != closest)
+            i++;
+        dist = closest;
+        id = this->id(type, base + i);
+    }
+}
+
+// cloned with the batches it inlines: calling cloned batches from the baseline traversal
+// costs several times more than the batches themselves
+KERNEL_CLONES
+bool Primitives::intersect(const Vec3f &orig, const Vec3f &dir, float &dist, unsigned &id, size_t &tests) const
+{
+    const float start = dist;
+    const Vec3f inv_dir(1 / dir.x, 1 / dir.y, 1 / dir.z);
+    float near;
+    // the tree tests a lone leaf without its box, a batch costs more than the box
+    if (!ray_box(min, max, orig, inv_dir, dist, near))
+        return false;
+    tests += bvh.traverse(orig, dir, dist, [&](unsigned b, float &d) { batch_intersect(b, orig, dir, inv_dir, d, id); });
+    return dist < start;
+}
+
+bool Primitives::intersect(unsigned id, const Vec3f &orig, const Vec3f &dir, float &dist) const
+{
+    float t[PRIMITIVE_BATCH];
+    const size_t i = index(id), base = i - i % PRIMITIVE_BATCH;
+    switch (type(id))
+    {
+    case BOX:
+        if (i >= boxes.count)
+            return false;
+        box_batch(base, orig, Vec3f(1 / dir.x, 1 / dir.y, 1 / dir.z), t);
+        break;
+    case PLANE:
+        if (i >= planes.count)
+            return false;
+        plane_batch(base, orig, dir, t);
+        break;
+    case DISC:
+        if (i >= discs.count)
+            return false;
+        disc_batch(base, orig, dir, t);
+        break;
+    case CYLINDER:
+        if (i >= cylinders.count)
+            return false;
+        cylinder_batch(base, orig, dir, t);
+        break;
+    default:
+        return false;
+    }
+    dist = t[i - base];
+    return dist < NO_HIT;
+}
+
+Vec3f Primitives::normal(unsigned id, const Vec3f &hit) const
+{
+    const size_t i = index(id);
+    switch (type(id))
+    {
+    case BOX:
+    {
+        // the face is along the axis where hit is the farthest from the center, relative to the size
+        Vec3f min(boxes.column[BOX_MIN + X][i], boxes.column[BOX_MIN + Y][i], boxes.column[BOX_MIN + Z][i]);
+        Vec3f max(boxes.column[BOX_MAX + X][i], boxes.column[BOX_MAX + Y][i], boxes.column[BOX_MAX + Z][i]);
+        Vec3f p = hit - (min + max) * .5f, N;
+        size_t axis = 0;
+        float best = 0;
+        for (size_t k = 0; k < 3; k++)
+        {
+            float d = std::fabs(p[k]) / (max[k] - min[k]);
+            if (d > best)
+            {
+                best = d;
+                axis = k;
+            }
+        }
+        N[axis] = p[axis] < 0 ? -1 : 1;
+        return N;
+    }
+    case PLANE:
+        return Vec3f(planes.column[PLANE_NORMAL + X][i], planes.column[PLANE_NORMAL + Y][i], planes.column[PLANE_NORMAL + Z][i]);
+    case DISC:
+        return Vec3f(discs.column[DISC_NORMAL + X][i], discs.column[DISC_NORMAL + Y][i], discs.column[DISC_NORMAL + Z][i]);
+    case CYLINDER:
+    {
+        Vec3f a(cylinders.column[CYLINDER_AXIS + X][i], cylinders.column[CYLINDER_AXIS + Y][i], cylinders.column[CYLINDER_AXIS + Z][i]);
+        Vec3f p = hit - Vec3f(cylinders.column[CYLINDER_BASE + X][i], cylinders.column[CYLINDER_BASE + Y][i],
+                              cylinders.column[CYLINDER_BASE + Z][i]);
+        float h = p * a, height = cylinders.column[CYLINDER_HEIGHT][i];
+        // on a cap when closer to it than to the side
+        float side = std::sqrt(cylinders.column[CYLINDER_R2][i]) - (p - a * h).norm();
+        if (h < side || height - h < side)
+            return h * 2 < height ? -a : a;
+        return (p - a * h).normalize();
+    }
+    default:
+        return Vec3f(0, 1, 0);
+    }
+}
+
+unsigned Primitives::material(unsigned id) const
+{
+    const size_t i = index(id);
+    switch (type(id))
+    {
+    case BOX:
+        return boxes.material[i];
+    case PLANE:
+        return planes.material[i];
+    case DISC:
+        return discs.material[i];
+    default:
+        return cylinders.material[i];
+    }
+}
+
+bool Primitives::odd_square(unsigned id, const Vec3f &hit) const
+{
+    const size_t i = index(id);
+    float checker = type(id) == PLANE ? planes.column[PLANE_CHECKER][i] : 0;
+    if (checker <= 0)
+        return false;
+    Vec3f u(planes.column[PLANE_UNIT_U + X][i], planes.column[PLANE_UNIT_U + Y][i], planes.column[PLANE_UNIT_U + Z][i]);
+    Vec3f v(planes.column[PLANE_UNIT_V + X][i], planes.column[PLANE_UNIT_V + Y][i], planes.column[PLANE_UNIT_V + Z][i]);
+    return (int(std::floor(hit * u / checker)) + int(std::floor(hit * v / checker))) & 1;
+}
+
+void Primitives::bounds(unsigned id, Vec3f &min, Vec3f &max) const
+{
+    const size_t i = index(id);
+    switch (type(id))
+    {
+    case BOX:
+        for (size_t k = 0; k < 3; k++)
+        {
+            min[k] = boxes.column[BOX_MIN + k][i];
+            max[k] = boxes.column[BOX_MAX + k][i];
+        }
+        break;
+    case PLANE:
+    {
+        Vec3f o(planes.column[PLANE_ORIGIN + X][i], planes.column[PLANE_ORIGIN + Y][i], planes.column[PLANE_ORIGIN + Z][i]);
+        Vec3f su(planes.column[PLANE_U + X][i], planes.column[PLANE_U + Y][i], planes.column[PLANE_U + Z][i]);
+        Vec3f sv(planes.column[PLANE_V + X][i], planes.column[PLANE_V + Y][i], planes.column[PLANE_V + Z][i]);
+        Vec3f u = su * (1 / (su * su)), v = sv * (1 / (sv * sv));
+        min = max = o;
+        const Vec3f corners[3] = {o + u, o + v, o + u + v};
+        for (const Vec3f &c : corners)
+            for (size_t k = 0; k < 3; k++)
+            {
+                min[k] = std::min(min[k], c[k]);
+                max[k] = std::max(max[k], c[k]);
+            }
+        break;
+    }
+    case DISC:
+    {
+        // the disc is within radius.sqrt(1 - n_k^2) of the center along axis k
+        float r2 = discs.column[DISC_R2][i];
+        for (size_t k = 0; k < 3; k++)
+        {
+            float n = discs.column[DISC_NORMAL + k][i], e = std::sqrt(std::max(0.f, r2 * (1 - n * n)));
+            min[k] = discs.column[DISC_CENTER + k][i] - e;
+            max[k] = discs.column[DISC_CENTER + k][i] + e;
+        }
+        break;
+    }
+    default:
+    {
+        float r2 = cylinders.column[CYLINDER_R2][i], height = cylinders.column[CYLINDER_HEIGHT][i];
+        for (size_t k = 0; k < 3; k++)
+        {
+            float a = cylinders.column[CYLINDER_AXIS + k][i], e = std::sqrt(std::max(0.f, r2 * (1 - a * a)));
+            float b0 = cylinders.column[CYLINDER_BASE + k][i], b1 = b0 + a * height;
+            min[k] = std::min(b0, b1) - e;
+            max[k] = std::max(b0, b1) + e;
+        }
+    }
+    }
+}
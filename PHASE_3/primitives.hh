@@ -0,0 +1,89 @@
+#ifndef _PRIMITIVES_HH
+#define _PRIMITIVES_HH
+
+#include <vector>
+
+#include "geometry.hh"
+#include "bvh.hh"
+
+// primitives of a type are tested against a ray that many at a time, their
+// arrays are padded with primitives no ray can hit
+#define PRIMITIVE_BATCH 8
+
+// Analytic scene primitives. Each type is stored as a structure of arrays so
+// that the intersection of a ray with a batch of them compiles to vector
+// instructions. A primitive is designated by an id packing its type and its
+// index among the primitives of that type. A bounding volume hierarchy indexes
+// the batches, whose primitives are sorted along a Morton curve beforehand, so
+// that every batch gathers neighbours within a tight box.
+class Primitives {
+public:
+  enum Type { BOX, PLANE, DISC, CYLINDER, TYPES };
+
+private:
+  template <unsigned N>
+  struct Columns {
+    std::vector<float> column[N];
+    std::vector<unsigned> material;
+    size_t count;
+    Columns() : count(0) {};
+    void push(const float (&values)[N], unsigned m, const float (&padding)[N]);
+    // the primitive at index i moves to the index of i in order
+    void permute(const std::vector<unsigned> &order);
+  };
+  Columns<6> boxes;      // min, max
+  Columns<19> planes;    // origin, normal, u and v edges over their squared lengths, checker size, unit u and v
+  Columns<7> discs;      // center, normal, squared radius
+  Columns<8> cylinders;  // base center, unit axis, height, squared radius
+  Vec3f min, max;        // bounds of all the primitives, rays missing them skip the tree
+  std::vector<unsigned> batches;           // id of the first primitive of every batch, the tree items
+  std::vector<Vec3f> batch_min, batch_max; // bounds of the primitives of every batch
+  Bvh bvh;
+  bool grown; // primitives added since the tree was built
+  unsigned added(unsigned id);
+  size_t count(Type type) const;
+  template <unsigned N>
+  void sort(Type type, Columns<N> &columns);
+  void batch_intersect(unsigned b, const Vec3f &orig, const Vec3f &dir, const Vec3f &inv_dir, float &dist,
+                       unsigned &id) const;
+
+  void box_batch(size_t base, const Vec3f &orig, const Vec3f &inv_dir, float *t) const;
+  void plane_batch(size_t base, const Vec3f &orig, const Vec3f &dir, float *t) const;
+  void disc_batch(size_t base, const Vec3f &orig, const Vec3f &dir, float *t) const;
+  void cylinder_batch(size_t base, const Vec3f &orig, const Vec3f &dir, float *t) const;
+
+public:
+  Primitives() : min(1e30, 1e30, 1e30), max(-1e30, -1e30, -1e30), grown(false) {};
+  static unsigned id(Type type, size_t index) { return unsigned(index) * TYPES + type; };
+  static Type type(unsigned id) { return Type(id % TYPES); };
+  static size_t index(unsigned id) { return id / TYPES; };
+
+  // material is an index the caller gives meaning to. The ids returned hold until update().
+  unsigned add_box(const Vec3f &min, const Vec3f &max, unsigned material);
+  // the parallelogram origin + a.u + b.v for a and b in [0, 1], with a checker
+  // pattern of squares of that size along u and v if checker > 0. The squares
+  // are aligned on the world origin, so that neighbouring planes match.
+  unsigned add_plane(const Vec3f &origin, const Vec3f &u, const Vec3f &v, unsigned material, float checker = 0);
+  unsigned add_disc(const Vec3f &center, const Vec3f &normal, float radius, unsigned material);
+  // closed cylinder from base to base + axis
+  unsigned add_cylinder(const Vec3f &base, const Vec3f &axis, float radius, unsigned material);
+  size_t size() const { return boxes.count + planes.count + discs.count + cylinders.count; };
+  bool empty() const { return !size(); };
+  // brings the tree up to date with the primitives added since the last call. The
+  // primitives of every type are sorted again, which changes their ids.
+  void update();
+
+  // closest primitive hit before dist, which is then updated. tests counts the batches tested.
+  bool intersect(const Vec3f &orig, const Vec3f &dir, float &dist, unsigned &id, size_t &tests) const;
+  // the same for primitive id alone
+  bool intersect(unsigned id, const Vec3f &orig, const Vec3f &dir, float &dist) const;
+  // unit normal at the point hit of the surface of primitive id, facing outwards
+  Vec3f normal(unsigned id, const Vec3f &hit) const;
+  unsigned material(unsigned id) const;
+  // for a checkered plane, whether hit lies in an odd square
+  bool odd_square(unsigned id, const Vec3f &hit) const;
+  // bounding box of primitive id
+  void bounds(unsigned id, Vec3f &min, Vec3f &max) const;
+};
+
+#endif
@@ -0,0 +1,136 @@
+#include <cmath>
+#include <algorithm>
+
+#include "quads.hh"
+
+TextureAtlas::Rect TextureAtlas::add(const unsigned char *rgba, int w, int h)
+{
+    if (w > width)
+    {
+        // the rows keep their texels at the same coordinates
+        std::vector<Vec4f> wider(w * height);
+        for (int y = 0; y < height; y++)
+            std::copy(texels.begin() + y * width, texels.begin() + (y + 1) * width, wider.begin() + y * w);
+        texels.swap(wider);
+        width = w;
+    }
+    if (row_x + w > width)
+    {
+        row_y += row_height;
+        row_x = row_height = 0;
+    }
+    Rect rect = {row_x, row_y, w, h};
+    row_x += w;
+    row_height = std::max(row_height, h);
+    if (row_y + row_height > height)
+    {
+        height = row_y + row_height;
+        texels.resize(width * height);
+    }
+    for (int y = 0; y < h; y++)
+        for (int x = 0; x < w; x++)
+        {
+            const unsigned char *p = rgba + 4 * (x + y * w);
+            texels[rect.x + x + (rect.y + y) * width] = Vec4f(p[0], p[1], p[2], p[3]) * (1. / 255);
+        }
+    return rect;
+}
+
+unsigned Quads::add_texture(const unsigned char *rgba, int w, int h)
+{
+    textures.push_back(atlas->add(rgba, w, h));
+    return textures.size() - 1;
+}
+
+unsigned Quads::add(const Vec3f &center, const Vec3f &normal, const Vec3f &horizontal, float width, float height,
+                    unsigned texture, unsigned material)
+{
+    Quad quad;
+    quad.center = center;
+    quad.width = width;
+    quad.height = height;
+    quad.rect = textures[texture];
+    quad.material = material;
+    quads.push_back(quad);
+    min.push_back(Vec3f());
+    max.push_back(Vec3f());
+    orient(quads.size() - 1, normal, horizontal);
+    added = true;
+    return quads.size() - 1;
+}
+
+void Quads::orient(unsigned q, const Vec3f &normal, const Vec3f &horizontal)
+{
+    Quad &quad = quads[q];
+    quad.N = normal;
+    quad.H = horizontal;
+    quad.V = cross(horizontal, normal);
+    bounds(q);
+    moved = true;
+}
+
+// box of the four corners, slightly enlarged: a flat box could miss rays grazing the quad edges
+void Quads::bounds(unsigned q)
+{
+    const Quad &quad = quads[q];
+    Vec3f h = quad.H * (quad.width / 2), v = quad.V * (quad.height / 2);
+    for (size_t k = 0; k < 3; k++)
+    {
+        float extent = std::fabs(h[k]) + std::fabs(v[k]) + 1e-3f;
+        min[q][k] = quad.center[k] - extent;
+        max[q][k] = quad.center[k] + extent;
+    }
+}
+
+void Quads::update()
+{
+    if (added)
+        bvh.build(min, max);
+    else if (moved)
+        bvh.refit(min, max);
+    added = moved = false;
+}
+
+// the texel hit, alpha tested, with the arithmetic of the original logo plane
+inline bool Quads::quad_intersect(const Quad &quad, const Vec3f &orig, const Vec3f &dir, float &dist, Vec3f &hit,
+                                  const Vec4f *&texel) const
+{
+    Vec3f p = quad.center - orig;
+    // compute point on the quad plane
+    float d = (p * quad.N) / (dir * quad.N);
+    p = dir * d - p;
+    if (fabs(p * quad.V) * 2 < quad.height && fabs(p * quad.H) * 2 < quad.width && d > 0 && d < dist)
+    {
+        unsigned x = (p * quad.H + quad.width / 2) / quad.width * quad.rect.width;
+        unsigned y = (p * quad.V + quad.height / 2) / quad.height * quad.rect.height;
+        const Vec4f &t = atlas->texel(quad.rect.x + x, quad.rect.y + y);
+        if (t.w > 0)
+        {
+            dist = d;
+            hit = p + quad.center;
+            texel = &t;
+            return true;
+        }
+    }
+    return false;
+}
+
+// not cloned: the wider instruction sets make the traversal several times slower
+bool Quads::intersect(const Vec3f &orig, const Vec3f &dir, float &dist, unsigned &quad, Vec3f &hit, Vec4f &texel,
+                      size_t &tests) const
+{
+    const Vec4f *found = nullptr;
+    tests += bvh.traverse(orig, dir, dist, [&](unsigned q, float &d) {
+        if (quad_intersect(quads[q], orig, dir, d, hit, found))
+            quad = q;
+    });
+    if (found)
+        texel = *found;
+    return found;
+}
+
+bool Quads::intersect(unsigned q, const Vec3f &orig, const Vec3f &dir, float &dist, Vec3f &hit) const
+{
+    const Vec4f *texel;
+    return q < quads.size() && quad_intersect(quads[q], orig, dir, dist, hit, texel);
+}
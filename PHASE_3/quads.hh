@@ -0,0 +1,73 @@
+#ifndef _QUADS_HH
+#define _QUADS_HH
+
+#include <vector>
+#include <memory>
+
+#include "geometry.hh"
+#include "bvh.hh"
+
+// width of the atlas, wider pictures widen it
+#define ATLAS_WIDTH 1024
+
+// Pictures packed in one texture, left to right in rows of the height of
+// their tallest picture. The atlas only grows: texture coordinates stay valid.
+class TextureAtlas {
+public:
+  struct Rect { int x, y, width, height; };
+
+private:
+  int width, height;
+  std::vector<Vec4f> texels;
+  int row_x, row_y, row_height; // the row being filled
+
+public:
+  TextureAtlas() : width(ATLAS_WIDTH), height(0), row_x(0), row_y(0), row_height(0) {};
+  // copies the w x h RGBA picture, returns where it is
+  Rect add(const unsigned char *rgba, int w, int h);
+  const Vec4f &texel(int x, int y) const { return texels[x + y * width]; };
+};
+
+// Textured rectangles, each independently oriented, whose fully transparent
+// texels let rays through. A bounding volume hierarchy indexes them.
+class Quads {
+public:
+  struct Quad {
+    Vec3f center;
+    Vec3f N, H, V;         // unit normal, horizontal and vertical axes of the picture
+    float width, height;   // world units
+    TextureAtlas::Rect rect;
+    unsigned material;     // an index the caller gives meaning to
+  };
+
+private:
+  std::shared_ptr<TextureAtlas> atlas; // shared by the copies of the scene every worker gets
+  std::vector<TextureAtlas::Rect> textures;
+  std::vector<Quad> quads;
+  std::vector<Vec3f> min, max; // of every quad, the tree input
+  Bvh bvh;
+  bool added, moved; // since the tree was last built or refit
+  void bounds(unsigned q);
+  bool quad_intersect(const Quad &quad, const Vec3f &orig, const Vec3f &dir, float &dist, Vec3f &hit,
+                      const Vec4f *&texel) const;
+
+public:
+  Quads() : atlas(new TextureAtlas()), added(false), moved(false) {};
+  unsigned add_texture(const unsigned char *rgba, int w, int h);
+  // the picture of texture is laid along horizontal, upright along cross(horizontal, normal)
+  unsigned add(const Vec3f &center, const Vec3f &normal, const Vec3f &horizontal, float width, float height,
+               unsigned texture, unsigned material);
+  void orient(unsigned q, const Vec3f &normal, const Vec3f &horizontal);
+  // brings the tree up to date with the quads added or oriented since the last call
+  void update();
+  size_t size() const { return quads.size(); };
+  const Quad &operator[](unsigned q) const { return quads[q]; };
+
+  // closest opaque texel hit before dist, which is then updated. tests counts the quads tested.
+  bool intersect(const Vec3f &orig, const Vec3f &dir, float &dist, unsigned &quad, Vec3f &hit, Vec4f &texel,
+                 size_t &tests) const;
+  // the same for quad q alone
+  bool intersect(unsigned q, const Vec3f &orig, const Vec3f &dir, float &dist, Vec3f &hit) const;
+};
+
+#endif
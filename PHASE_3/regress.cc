@@ -0,0 +1,150 @@
+#include <cmath>
+#include <cerrno>
+#include <fstream>
+#include <iostream>
+#include <algorithm>
+#include <chrono>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "regress.hh"
+#include "dispatch.hh"
+
+// default view of out.jpg, a moved camera and several time points of the PHASE_3 animation
+static const RegressScene scenes[] = {
+    {"default", 0, 0, 15, -0.5, 4, 45., 16},
+    {"camera", 10, 20, 15, -0.5, 4, 45., 16},
+    {"anim_start", 0, 0, 15, -0.5, 3, 45., 16},
+    {"anim_low_big", 0, 0, 51, -1, 4, 45., 16},
+    {"anim_high_small", 0, 0, 105, 0, 3, 45., 16},
+    {"anim_logo_edge", 0, 0, 195, -0.25, 3.5, 45., 16},
+};
+
+static std::string hostname()
+{
+    char name[256] = "";
+    gethostname(name, sizeof(name) - 1);
+    return name;
+}
+
+// PSNR and channel difference at quantile (1 for the largest) between two RGBA pictures of the same size
+static void compare(const unsigned char *a, const unsigned char *b, size_t pixels, double quantile,
+                    double &psnr, int &error)
+{
+    double se = 0;
+    size_t histogram[256] = {0};
+    for (size_t i = 0; i < 4 * pixels; i++)
+    {
+        int e = std::abs(int(a[i]) - int(b[i]));
+        histogram[e]++;
+        se += e * e;
+    }
+    double mse = se / (3 * pixels); // alpha is always 255
+    psnr = mse > 0 ? 10 * std::log10(255. * 255. / mse) : 99.;
+
+    size_t below = 4 * pixels - size_t(std::ceil((1 - quantile) * 3 * pixels));
+    error = 0;
+    for (size_t count = histogram[0]; count < below && error < 255; count += histogram[++error])
+        ;
+}
+
+int run_regression(Tinyraytracer &tinyraytracer, const std::string &dir, const std::string &variant,
+                   const std::string &options, RegressMode mode)
+{
+    const unsigned w = tinyraytracer.get_width(), h = tinyraytracer.get_height();
+    std::vector<unsigned char> pixmap(4 * w * h);
+    const bool fast = tinyraytracer.get_fast_math();
+    const double quantile = fast ? REGRESS_FAST_QUANTILE : 1.;
+    int failures = 0;
+    std::cout << "kernels " << kernel_isa() << ", engine " << engine_name(tinyraytracer.get_engine())
+              << (fast ? ", fast math" : "") << (tinyraytracer.get_wavefront() ? ", wavefront" : "") << std::endl;
+    if (mode == REGRESS_UPDATE && fast)
+    {
+        std::cerr << "Error: golden images must come from the exact shading, drop -fast-math" << std::endl;
+        return 1;
+    }
+    const std::string timings = std::string(REGRESS_TIMINGS) + "/" + hostname();
+    if (mode == REGRESS_TIME && ((mkdir(REGRESS_TIMINGS, 0755) && errno != EEXIST) ||
+                                 (mkdir(timings.c_str(), 0755) && errno != EEXIST)))
+    {
+        std::cerr << "Error: can not create " << timings << std::endl;
+        return 1;
+    }
+
+    for (size_t s = 0; s < sizeof(scenes) / sizeof(scenes[0]); s++)
+    {
+        const RegressScene &scene = scenes[s];
+        std::string path = dir + "/" + scene.name + variant;
+        const std::string timing_path = timings + "/" + scene.name + options + ".time";
+
+        double best = 1e30;
+        for (int run = 0; run < REGRESS_RUNS; run++)
+        {
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            tinyraytracer.render(pixmap.data(), scene.anglev, scene.angleh, scene.anglel, scene.z_red, scene.size_mirror);
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+            best = std::min(best, elapsed.count());
+        }
+
+        if (mode == REGRESS_UPDATE)
+        {
+            sf::Image image;
+            image.create(w, h, pixmap.data());
+            if (!image.saveToFile(path + ".png"))
+            {
+                std::cerr << "Error: can not write " << path << std::endl;
+                failures++;
+                continue;
+            }
+            std::cout << "UPDATED " << path << " " << best << "s" << std::endl;
+            continue;
+        }
+
+        sf::Image golden;
+        if (!golden.loadFromFile(path + ".png") || golden.getSize().x != w || golden.getSize().y != h)
+        {
+            std::cout << "FAIL " << path << ": no golden image of " << w << "x" << h << std::endl;
+            failures++;
+            continue;
+        }
+        double psnr;
+        int error;
+        compare(pixmap.data(), golden.getPixelsPtr(), w * h, quantile, psnr, error);
+        bool ok = psnr >= scene.min_psnr && error <= scene.max_error;
+
+        if (mode == REGRESS_TIME)
+        {
+            // a wrong render is no baseline
+            if (ok)
+            {
+                std::ofstream timing(timing_path.c_str());
+                if (!(timing << best << std::endl))
+                {
+                    std::cerr << "Error: can not write " << timing_path << std::endl;
+                    failures++;
+                    continue;
+                }
+            }
+            std::cout << (ok ? "TIMED " : "FAIL ") << path << ": psnr " << psnr << " dB, "
+                      << (fast ? "99.9% error " : "max error ") << error << ", " << best << "s" << std::endl;
+            failures += !ok;
+            continue;
+        }
+
+        double baseline = 0;
+        std::ifstream timing(timing_path.c_str());
+        bool timed = bool(timing >> baseline);
+        bool slow = timed && best > baseline * (1 + REGRESS_TIME_TOLERANCE);
+        ok &= !slow;
+
+        std::cout << (ok ? "PASS " : "FAIL ") << path << ": psnr " << psnr << " dB, " << (fast ? "99.9% error " : "max error ") << error
+                  << ", " << best << "s";
+        if (timed)
+            std::cout << " (recorded " << baseline << "s" << (slow ? ", too slow)" : ")");
+        else
+            std::cout << " (timing not checked, none recorded on this machine: make regress-time)";
+        std::cout << std::endl;
+        failures += !ok;
+    }
+    return failures;
+}
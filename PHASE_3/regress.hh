@@ -0,0 +1,41 @@
+#ifndef _REGRESS_HH
+#define _REGRESS_HH
+
+#include <string>
+
+#include "tinyraytracer.hh"
+
+// a scene may take that much longer than the timing recorded on the same machine with the same options
+#define REGRESS_TIME_TOLERANCE 0.25
+// where the timings are recorded, in a directory per machine: they are not comparable across machines
+#define REGRESS_TIMINGS "timings"
+// every scene is rendered that many times, the fastest run is kept
+#define REGRESS_RUNS 3
+// with -fast-math, max_error bounds this quantile of the channel errors instead of
+// the largest one: an approximated atan2/acos may pick the neighbouring envmap texel
+#define REGRESS_FAST_QUANTILE 0.999
+
+// One reference picture: camera and animation parameters, and how far the
+// render may drift from the golden image before the regression fails
+struct RegressScene {
+  const char *name;
+  float anglev, angleh, anglel, z_red, size_mirror;
+  double min_psnr; // dB
+  int max_error;   // on any 8 bit channel
+};
+
+enum RegressMode {
+  REGRESS_CHECK,  // compares the renders with the goldens, and their timings with those recorded
+  REGRESS_UPDATE, // rewrites the goldens
+  REGRESS_TIME    // records the timings of the renders matching their goldens, the goldens are kept
+};
+
+// Renders every reference scene and compares it with dir/<scene><variant>.png, variant
+// naming the scene options ("" or e.g. "_board_mesh"), and its timing with the one in
+// REGRESS_TIMINGS/<host>/<scene><options>.time, options naming every option of the run
+// (e.g. "_board_engine=tiles"). The goldens always come from the exact shading, fast
+// renders are checked against them. Returns the number of failing scenes.
+int run_regression(Tinyraytracer &tinyraytracer, const std::string &dir, const std::string &variant,
+                   const std::string &options, RegressMode mode);
+
+#endif
@@ -0,0 +1,32 @@
+#include <cmath>
+#include <algorithm>
+
+#include "resolution.hh"
+
+ResolutionController::ResolutionController(unsigned w, unsigned h, float target_fps, unsigned workers)
+    : max_width(w), max_height(h), workers(std::max(1u, workers)), target_frame_time(1.f / target_fps), scale(1.f)
+{
+}
+
+void ResolutionController::frame_done(float render_seconds, unsigned w, unsigned h)
+{
+    if (render_seconds <= 0.f || w == 0 || h == 0)
+        return;
+    // frames are rendered concurrently, one per worker
+    float frame_time = render_seconds / workers;
+    float frame_scale = std::sqrt(float(w) * h / (float(max_width) * max_height));
+    float wanted = frame_scale * std::sqrt(target_frame_time / frame_time);
+    // exponential smoothing keeps the resolution from oscillating frame to frame
+    scale += 0.2f * (wanted - scale);
+    scale = std::max(RESOLUTION_MIN_SCALE, std::min(1.f, scale));
+}
+
+unsigned ResolutionController::width() const
+{
+    return std::max(4u, unsigned(max_width * scale) & ~3u);
+}
+
+unsigned ResolutionController::height() const
+{
+    return std::max(4u, unsigned(max_height * scale) & ~3u);
+}
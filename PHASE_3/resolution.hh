@@ -0,0 +1,24 @@
+#ifndef _RESOLUTION_HH
+#define _RESOLUTION_HH
+
+// smallest fraction of the window resolution the controller may fall back to
+#define RESOLUTION_MIN_SCALE 0.25f
+
+// Chooses the internal render resolution of the next frames so that the
+// compute threads keep up with a target frame rate. Render time is assumed
+// proportional to the number of pixels, frames are then upscaled to the window.
+class ResolutionController {
+  unsigned max_width, max_height;
+  unsigned workers;
+  float target_frame_time;
+  float scale;
+
+public:
+  ResolutionController(unsigned w, unsigned h, float target_fps, unsigned workers);
+  // feeds back how long a worker took to render a frame of w x h pixels
+  void frame_done(float render_seconds, unsigned w, unsigned h);
+  unsigned width() const;
+  unsigned height() const;
+};
+
+#endif
@@ -5,39 +5,26 @@
 #include <fstream>
 #include <vector>
 #include <algorithm>
+#include <chrono>
+#include <thread>
+#include <cstring>
+#include <omp.h>
 
 #include "geometry.hh"
 #include "tinyraytracer.hh"
+#include "trace.hh"
+#include "dispatch.hh"
 
-// #define RENDER_BOARD
-// #define RENDER_DUCK
-#ifdef RENDER_DUCK
-#include "model.hh"
-#endif
+static const unsigned kernel_depths[] = {KERNEL_DEPTHS};
 
-#define LOGO_DPI 100
-
-#ifdef RENDER_DUCK
-Model duck("duck.obj");
-Material duck_material(1.0, Vec4f(0.9, 0.1, 0.0, 0.0), Vec3f(0.3, 0.1, 0.1), 10.);
-#endif
-
-static Vec3f reflect(const Vec3f &I, const Vec3f &N)
-{
-    return I - N * 2.f * (I * N);
-}
-
-static Vec3f refract(const Vec3f &I, const Vec3f &N, const float eta_t, const float eta_i = 1.f)
-{ // Snell's law
-    float cosi = -std::max(-1.f, std::min(1.f, I * N));
-    if (cosi < 0)
-        return refract(I, -N, eta_i, eta_t); // if the ray comes from the inside the object, swap the air and the media
-    float eta = eta_i / eta_t;
-    float k = 1 - eta * eta * (1 - cosi * cosi);
-    return k < 0 ? Vec3f(1, 0, 0) : I * eta + N * (eta * cosi - sqrtf(k)); // k<0 = total reflection, no ray to refract. I refract it anyways, this has no physical meaning
-}
+// one row per entry of KERNEL_DEPTHS, in the same order
+#define KERNELS(F, D) {&Tinyraytracer::cast_ray<F, D>, &Tinyraytracer::render_tile<F, D>, &Tinyraytracer::render_wavefront<F, D>}
+#define KERNELS_FOR_DEPTH(D) {KERNELS(0, D), KERNELS(1, D), KERNELS(2, D), KERNELS(3, D)}
+const Tinyraytracer::Kernels Tinyraytracer::kernel_table[][FEATURE_MASKS] = {
+    KERNELS_FOR_DEPTH(4), KERNELS_FOR_DEPTH(1), KERNELS_FOR_DEPTH(2), KERNELS_FOR_DEPTH(8)};
 
 Tinyraytracer::Tinyraytracer(unsigned w, unsigned h, sf::Image env_img, sf::Image logo_img, Vec3f apos)
+    : workers("tiles")
 {
     width = w;
     height = h;
@@ -47,133 +34,362 @@ Tinyraytracer::Tinyraytracer(unsigned w, unsigned h, sf::Image env_img, sf::Imag
     envmap = std::vector<Vec3f>(envmap_width * envmap_height);
     for (int i = 0; i < envmap_height * envmap_width; i++)
         envmap[i] = Vec3f(pixmap[4 * i + 0], pixmap[4 * i + 1], pixmap[4 * i + 2]) * (1 / 255.);
-    pixmap = logo_img.getPixelsPtr();
-    logo_width = logo_img.getSize().x;
-    logo_height = logo_img.getSize().y;
-    logo_fwidth = logo_width * 1. / LOGO_DPI;
-    logo_fheight = logo_height * 1. / LOGO_DPI;
-    logo = std::vector<Vec4f>(logo_width * logo_height);
-    for (int i = 0; i < logo_height * logo_width; i++)
-        logo[i] = Vec4f(pixmap[4 * i + 0], pixmap[4 * i + 1],
-                        pixmap[4 * i + 2], pixmap[4 * i + 3]) *
-                  (1. / 255);
-    logo_material = Material(1.0, Vec4f(1, 0, 0, 0), Vec3f(0.1, 0.1, 0.3), 10.);
-    logo_pos = apos;
-}
-
-bool Tinyraytracer::scene_intersect(const Vec3f &orig, const Vec3f &dir, Vec3f &hit, Vec3f &N, float anglel, Material &material)
+    // oriented by update_logo
+    logo = add_quad(apos, Vec3f(0, 0, 1), Vec3f(1, 0, 0), logo_img.getSize().x * 1. / LOGO_DPI,
+                    logo_img.getSize().y * 1. / LOGO_DPI, add_texture(logo_img),
+                    Material(1.0, Vec4f(1, 0, 0, 0), Vec3f(0.1, 0.1, 0.3), 10.));
+    engine = ENGINE_FRAME_THREADS;
+    fast_math = false;
+    threads = std::max(1u, std::thread::hardware_concurrency());
+    wavefront = false;
+    shadow_cache = true;
+    grid = false;
+    lights_changed = true;
+    light_samples = 0;
+    max_depth = kernel_depths[0];
+    select_kernels();
+}
+
+void Tinyraytracer::select_kernels()
+{
+    size_t d = 0;
+    while (kernel_depths[d] != max_depth)
+        d++;
+    kernels = &kernel_table[d][features()];
+}
+
+bool Tinyraytracer::set_max_depth(unsigned depth)
 {
+    if (std::find(std::begin(kernel_depths), std::end(kernel_depths), depth) == std::end(kernel_depths))
+        return false;
+    max_depth = depth;
+    select_kernels();
+    return true;
+}
+
+static const char *engine_names[] = {"seq", "omp", "frame-threads", "tiles"};
+
+bool parse_engine(const char *name, Engine &engine)
+{
+    for (int e = ENGINE_SEQ; e <= ENGINE_TILES; e++)
+        if (!strcmp(name, engine_names[e]))
+        {
+            engine = Engine(e);
+            return true;
+        }
+    return false;
+}
+
+const char *engine_name(Engine engine)
+{
+    return engine_names[engine];
+}
+
+template <unsigned Features>
+KERNEL_CLONES
+bool Tinyraytracer::scene_intersect(const Vec3f &orig, const Vec3f &dir, Vec3f &hit, Vec3f &N, Material &material,
+                                    RayCounters *counters, ObjectRef *object) const
+{
+    if (counters)
+    {
+        if (!grid)
+            counters->tests += spheres.size();
+    }
     float dist = std::numeric_limits<float>::max();
-    for (const auto &s : spheres)
+    unsigned sphere = 0;
+    bool sphere_hit = false;
+    if (grid)
     {
-        float dist_i;
-        if (s.ray_intersect(orig, dir, dist_i) && dist_i < dist)
+        SphereGrid::Walk walk(sphere_grid, orig, dir, dist);
+        const unsigned *first, *last;
+        while (walk.next(dist, first, last))
         {
-            dist = dist_i;
-            hit = orig + dir * dist_i;
-            N = (hit - s.center).normalize();
-            material = s.material;
+            if (counters)
+                counters->tests += last - first;
+            for (; first < last; first++)
+            {
+                float dist_i;
+                if (spheres[*first].ray_intersect(orig, dir, dist_i) && dist_i < dist)
+                {
+                    dist = dist_i;
+                    sphere = *first;
+                    sphere_hit = true;
+                }
+            }
         }
     }
-
-#ifdef RENDER_BOARD
-    float checkerboard_dist = std::numeric_limits<float>::max();
-    if (fabs(dir.y) > 1e-3)
-    {
-        float d = -(orig.y + 4) / dir.y; // the checkerboard plane has equation y = -4
-        Vec3f pt = orig + dir * d;
-        if (d > 0 && fabs(pt.x) < 10 && pt.z < -10 && pt.z > -30 && d < dist)
+    else
+        for (size_t i = 0; i < spheres.size(); i++)
         {
-            checkerboard_dist = d;
-            hit = pt;
-            N = Vec3f(0, 1, 0);
-            material.diffuse_color = (int(.5 * hit.x + 1000) + int(.5 * hit.z)) & 1 ? Vec3f(.3, .3, .3) : Vec3f(.3, .2, .1);
+            float dist_i;
+            if (spheres[i].ray_intersect(orig, dir, dist_i) && dist_i < dist)
+            {
+                dist = dist_i;
+                sphere = i;
+                sphere_hit = true;
+            }
         }
+    if (sphere_hit)
+    {
+        const Sphere &s = spheres[sphere];
+        hit = orig + dir * dist;
+        N = unit(hit - s.center);
+        material = s.material;
+        if (object)
+            *object = ObjectRef(ObjectRef::SPHERE, sphere);
     }
-    if (dist > checkerboard_dist)
-        dist = checkerboard_dist;
-#endif
-
-    logo_N = Vec3f(cos(anglel * M_PI / 180), 0., sin(anglel * M_PI / 180));
-    logo_H = Vec3f(cos((anglel - 90) * M_PI / 180), 0., sin((anglel - 90) * M_PI / 180));
-    logo_V = cross(logo_H, logo_N);
-    Vec3f p = logo_pos - orig;
-    // compute point on the logo plane
-    float logo_dist = (p * logo_N) / (dir * logo_N);
-    p = dir * logo_dist - p;
-    if (fabs(p * logo_V) * 2 < logo_fheight &&
-        fabs(p * logo_H) * 2 < logo_fwidth) // hit
-        if (logo_dist > 0 && logo_dist < dist)
+
+    unsigned id;
+    size_t primitive_tests = 0;
+    if ((Features & FEATURE_PRIMITIVES) && primitives.intersect(orig, dir, dist, id, primitive_tests))
+    {
+        hit = orig + dir * dist;
+        N = primitives.normal(id, hit);
+        material = primitive_materials[primitives.material(id) + primitives.odd_square(id, hit)];
+        if (object)
+            *object = ObjectRef(ObjectRef::PRIMITIVE, id);
+    }
+    if (counters)
+        counters->tests += primitive_tests;
+
+    unsigned quad;
+    Vec4f texel;
+    size_t quad_tests = 0;
+    if (quads.intersect(orig, dir, dist, quad, hit, texel, quad_tests))
+    {
+        N = quads[quad].N;
+        if (N * dir > 0)
+            N = -N;
+        material = quad_materials[quads[quad].material];
+        material.diffuse_color = Vec3f(texel.x, texel.y, texel.z);
+        material.albedo.x = texel.w;
+        material.albedo.w = 1. - texel.w;
+        if (object)
+            *object = ObjectRef(ObjectRef::QUAD, quad);
+    }
+    if (counters)
+        counters->tests += quad_tests;
+
+    if (Features & FEATURE_MESH)
+        for (size_t m = 0; m < meshes.size(); m++)
         {
-            unsigned x = (p * logo_H + logo_fwidth / 2) / logo_fwidth * logo_width;
-            unsigned y = (p * logo_V + logo_fheight / 2) / logo_fheight * logo_height;
-            unsigned i = (x + y * logo_width);
-            if (logo[i].w > 0)
+            int face;
+            Vec3f N2;
+            size_t mesh_tests = 0;
+            if (meshes[m].model->intersect(orig, dir, dist, face, N2, mesh_tests))
             {
-                dist = logo_dist;
-                hit = p + logo_pos;
-                N = logo_N;
-                if (N * dir > 0)
-                    N = -N;
-                material = logo_material;
-                material.diffuse_color = Vec3f(logo[i].x, logo[i].y, logo[i].z);
-                material.albedo.x = logo[i].w;
-                material.albedo.w = 1. - logo[i].w;
+                hit = orig + dir * dist;
+                N = unit(N2);
+                material = meshes[m].material;
+                if (object)
+                    *object = ObjectRef(ObjectRef::MESH, m, face);
             }
+            if (counters)
+                counters->tests += mesh_tests;
         }
+    return dist < 1000;
+}
 
-#ifdef RENDER_DUCK
-    for (int i = 0; i < duck.nfaces(); i++)
+void Tinyraytracer::gather_lights(const Vec3f &point, std::vector<LightSample> &out) const
+{
+    out.clear();
+    light_tree.query(lights, point, LIGHT_CUTOFF, out);
+    if (light_samples && out.size() > light_samples)
     {
-        float dist_i;
-        Vec3f N2;
-        if (duck.ray_triangle_intersect(i, orig, dir, dist_i, N2) && dist_i < dist)
+        // the draw depends on the point only, so that frames are reproducible whatever the thread
+        uint32_t bits[3];
+        memcpy(bits, &point.x, sizeof(bits));
+        select_lights(lights, out, light_samples, bits[0] * 73856093u ^ bits[1] * 19349663u ^ bits[2] * 83492791u);
+    }
+}
+
+void Tinyraytracer::add_particle(Sphere s, const Vec3f &pivot)
+{
+    Particle p;
+    p.sphere = spheres.size();
+    p.pivot = pivot;
+    p.offset = s.center - pivot;
+    particles.push_back(p);
+    spheres.push_back(s);
+}
+
+unsigned Tinyraytracer::add_texture(const sf::Image &img)
+{
+    return quads.add_texture(img.getPixelsPtr(), img.getSize().x, img.getSize().y);
+}
+
+unsigned Tinyraytracer::add_quad(const Vec3f &center, const Vec3f &normal, const Vec3f &horizontal, float width,
+                                 float height, unsigned texture, const Material &m)
+{
+    quad_materials.push_back(m);
+    return quads.add(center, normal, horizontal, width, height, texture, quad_materials.size() - 1);
+}
+
+void Tinyraytracer::add_box(const Vec3f &min, const Vec3f &max, const Material &m)
+{
+    primitives.add_box(min, max, primitive_materials.size());
+    primitive_materials.push_back(m);
+    select_kernels();
+}
+
+void Tinyraytracer::add_plane(const Vec3f &origin, const Vec3f &u, const Vec3f &v, const Material &m, float checker,
+                              const Material &odd)
+{
+    primitives.add_plane(origin, u, v, primitive_materials.size(), checker);
+    primitive_materials.push_back(m);
+    primitive_materials.push_back(odd); // the material of the odd squares follows
+    select_kernels();
+}
+
+void Tinyraytracer::add_disc(const Vec3f &center, const Vec3f &normal, float radius, const Material &m)
+{
+    primitives.add_disc(center, normal, radius, primitive_materials.size());
+    primitive_materials.push_back(m);
+    select_kernels();
+}
+
+void Tinyraytracer::add_cylinder(const Vec3f &base, const Vec3f &axis, float radius, const Material &m)
+{
+    primitives.add_cylinder(base, axis, radius, primitive_materials.size());
+    primitive_materials.push_back(m);
+    select_kernels();
+}
+
+void Tinyraytracer::add_board()
+{
+    Material light, dark;
+    light.diffuse_color = Vec3f(.3, .3, .3);
+    dark.diffuse_color = Vec3f(.3, .2, .1);
+    add_plane(Vec3f(-10, -4, -30), Vec3f(0, 0, 20), Vec3f(20, 0, 0), light, 2, dark);
+}
+
+// last object found blocking the shadow rays of every light, for the calling thread
+static std::vector<ObjectRef> &occluder_cache()
+{
+    static thread_local std::vector<ObjectRef> cache;
+    return cache;
+}
+
+template <unsigned Features>
+bool Tinyraytracer::occluded(size_t l, const Vec3f &orig, const Vec3f &dir, float distance, RayCounters *counters) const
+{
+    std::vector<ObjectRef> &cache = occluder_cache();
+    if (shadow_cache)
+    {
+        if (cache.size() <= l)
+            cache.resize(l + 1);
+        if (counters)
+            counters->shadow_lookups++;
+        if (cache[l].kind != ObjectRef::NONE)
         {
-            dist = dist_i;
-            hit = orig + dir * dist_i;
-            N = N2.normalize();
-            material = duck_material;
+            if (counters)
+                counters->tests++;
+            if (object_occludes<Features>(cache[l], orig, dir, distance))
+            {
+                if (counters)
+                    counters->shadow_hits++;
+                return true;
+            }
         }
     }
-#endif
-    return dist < 1000;
+
+    Vec3f shadow_pt, shadow_N;
+    Material tmpmaterial;
+    ObjectRef object;
+    if (scene_intersect<Features>(orig, dir, shadow_pt, shadow_N, tmpmaterial, counters, &object) &&
+        (shadow_pt - orig).norm() < distance)
+    {
+        if (shadow_cache)
+            cache[l] = object;
+        return true;
+    }
+    return false;
 }
 
-Vec3f Tinyraytracer::cast_ray(const Vec3f &orig, const Vec3f &dir, float anglel, size_t depth = 0)
+// the same tests as scene_intersect, for the one object
+template <unsigned Features>
+bool Tinyraytracer::object_occludes(const ObjectRef &object, const Vec3f &orig, const Vec3f &dir, float distance) const
 {
-    Vec3f point, N;
+    float dist = std::numeric_limits<float>::max();
+    Vec3f hit, N;
     Material material;
-
-    if (depth > 4 || !scene_intersect(orig, dir, point, N, anglel, material))
+    switch (object.kind)
     {
-        int a = std::max(0, std::min(envmap_width - 1, static_cast<int>((atan2(dir.z, dir.x) / (2 * M_PI) + .5) * envmap_width)));
-        int b = std::max(0, std::min(envmap_height - 1, static_cast<int>(acos(dir.y) / M_PI * envmap_height)));
-        return envmap[a + b * envmap_width]; // background color
-                                             //        return Vec3f(0.2, 0.7, 0.8); // background color
+    case ObjectRef::SPHERE:
+        if (object.index >= spheres.size() || !spheres[object.index].ray_intersect(orig, dir, dist))
+            return false;
+        hit = orig + dir * dist;
+        break;
+    case ObjectRef::PRIMITIVE:
+        if (!(Features & FEATURE_PRIMITIVES) || !primitives.intersect(object.index, orig, dir, dist))
+            return false;
+        hit = orig + dir * dist;
+        break;
+    case ObjectRef::QUAD:
+        if (!quads.intersect(object.index, orig, dir, dist, hit))
+            return false;
+        break;
+    case ObjectRef::MESH:
+        if (!(Features & FEATURE_MESH) || object.index >= meshes.size() ||
+            !meshes[object.index].model->intersect(object.face, orig, dir, dist, N))
+            return false;
+        hit = orig + dir * dist;
+        break;
+    default:
+        return false;
     }
+    return dist < 1000 && (hit - orig).norm() < distance;
+}
+
+// also called by the wavefront kernels in wavefront.cc
+#define INSTANTIATE(F) \
+    template bool Tinyraytracer::scene_intersect<F>(const Vec3f &, const Vec3f &, Vec3f &, Vec3f &, Material &, \
+                                                    RayCounters *, ObjectRef *) const; \
+    template bool Tinyraytracer::occluded<F>(size_t, const Vec3f &, const Vec3f &, float, RayCounters *) const;
+INSTANTIATE(0)
+INSTANTIATE(1)
+INSTANTIATE(2)
+INSTANTIATE(3)
+#undef INSTANTIATE
 
-    Vec3f reflect_dir = reflect(dir, N).normalize();
-    Vec3f refract_dir = refract(dir, N, material.refractive_index).normalize();
+template <unsigned Features, unsigned MaxDepth>
+KERNEL_CLONES
+Vec3f Tinyraytracer::cast_ray(const Vec3f &orig, const Vec3f &dir, size_t depth, RayCounters *counters) const
+{
+    Vec3f point, N;
+    Material material;
+
+    if (counters)
+        counters->rays++;
+    if (depth > MaxDepth || !scene_intersect<Features>(orig, dir, point, N, material, counters))
+        return envmap_lookup(dir); // background color
+
+    Vec3f reflect_dir = unit(reflect(dir, N));
+    Vec3f refract_dir = unit(refract(dir, N, material.refractive_index));
     Vec3f reflect_orig = reflect_dir * N < 0 ? point - N * 1e-3 : point + N * 1e-3; // offset the original point to avoid occlusion by the object itself
     Vec3f refract_orig = refract_dir * N < 0 ? point - N * 1e-3 : point + N * 1e-3;
-    Vec3f reflect_color = cast_ray(reflect_orig, reflect_dir, anglel, depth + 1);
-    Vec3f refract_color = cast_ray(refract_orig, refract_dir, anglel, depth + 1);
+    Vec3f reflect_color = cast_ray<Features, MaxDepth>(reflect_orig, reflect_dir, depth + 1, counters);
+    Vec3f refract_color = cast_ray<Features, MaxDepth>(refract_orig, refract_dir, depth + 1, counters);
 
+    static thread_local std::vector<LightSample> samples; // the light loop does not recurse
+    gather_lights(point, samples);
     float diffuse_light_intensity = 0, specular_light_intensity = 0;
-    for (size_t i = 0; i < lights.size(); i++)
+    for (const auto &sample : samples)
     {
-        Vec3f light_dir = (lights[i].position - point).normalize();
-        float light_distance = (lights[i].position - point).norm();
+        const size_t i = sample.light;
+        const float intensity = lights[i].intensity * sample.scale;
+        Vec3f light_dir;
+        float light_distance;
+        light_direction(lights[i], point, light_dir, light_distance);
 
         Vec3f shadow_orig = light_dir * N < 0 ? point - N * 1e-3 : point + N * 1e-3; // checking if the point lies in the shadow of the lights[i]
-        Vec3f shadow_pt, shadow_N;
-        Material tmpmaterial;
-        if (scene_intersect(shadow_orig, light_dir, shadow_pt, shadow_N, anglel, tmpmaterial) &&
-            (shadow_pt - shadow_orig).norm() < light_distance)
+        if (counters)
+            counters->rays++;
+        if (occluded<Features>(i, shadow_orig, light_dir, light_distance, counters))
             continue;
 
-        diffuse_light_intensity += lights[i].intensity * std::max(0.f, light_dir * N);
-        specular_light_intensity += powf(std::max(0.f, -reflect(-light_dir, N) * dir), material.specular_exponent) * lights[i].intensity;
+        diffuse_light_intensity += intensity * std::max(0.f, light_dir * N);
+        specular_light_intensity += specular(std::max(0.f, -reflect(-light_dir, N) * dir), material.specular_exponent) * intensity;
     }
     return material.diffuse_color * diffuse_light_intensity * material.albedo[0] + Vec3f(1., 1., 1.) * specular_light_intensity * material.albedo[1] + reflect_color * material.albedo[2] + refract_color * material.albedo[3];
 }
@@ -181,39 +397,216 @@ Vec3f Tinyraytracer::cast_ray(const Vec3f &orig, const Vec3f &dir, float anglel,
 sf::Image
 Tinyraytracer::render(float anglev, float angleh, float anglel, float z_red, float size_mirror)
 {
-    this->update_z_red(z_red);
-    this->update_size_mirror(size_mirror);
-    const float fov = M_PI / 3.;
     std::vector<unsigned char> pixmap(4 * width * height);
-    Vec3f ex(cos(angleh * M_PI / 180),
-             0,
-             -sin(angleh * M_PI / 180));
-    Vec3f ey(sin(anglev * M_PI / 180) * sin(angleh * M_PI / 180),
-             cos(anglev * M_PI / 180),
-             sin(anglev * M_PI / 180) * cos(angleh * M_PI / 180));
-    Vec3f ez(cos(anglev * M_PI / 180) * sin(angleh * M_PI / 180),
-             -sin(anglev * M_PI / 180),
-             cos(anglev * M_PI / 180) * cos(angleh * M_PI / 180));
+    render(pixmap.data(), anglev, angleh, anglel, z_red, size_mirror);
 
-    for (size_t j = 0; j < height; j++)
+    sf::Image result;
+    result.create(width, height, pixmap.data());
+    return result;
+}
+
+// renders straight into a caller owned RGBA buffer of 4 * width * height bytes
+bool Tinyraytracer::render(unsigned char *pixmap, float anglev, float angleh, float anglel, float z_red, float size_mirror,
+                           const CancelToken &cancel, RayCounters *counters)
+{
+    setup_frame(anglev, angleh, anglel, z_red, size_mirror);
+    const size_t tiles = ((width + TILE_SIZE - 1) / TILE_SIZE) * ((height + TILE_SIZE - 1) / TILE_SIZE);
+    std::atomic<size_t> next(0), done(0);
+
+    if (engine == ENGINE_SEQ || engine == ENGINE_FRAME_THREADS)
+    {
+        render_tiles(pixmap, &next, &done, &cancel, counters);
+        return done == tiles;
+    }
+
+    // every thread counts on its own, the totals are summed once the frame is done
+    std::vector<RayCounters> local(threads);
+    if (engine == ENGINE_OMP)
+    {
+#pragma omp parallel num_threads(threads)
+        render_tiles(pixmap, &next, &done, &cancel, counters ? &local[omp_get_thread_num()] : nullptr);
+    }
+    else
+        workers.run(threads, [&](unsigned t) {
+            render_tiles(pixmap, &next, &done, &cancel, counters ? &local[t] : nullptr);
+        });
+    for (size_t t = 0; counters && t < local.size(); t++)
+    {
+        counters->rays += local[t].rays;
+        counters->tests += local[t].tests;
+        counters->shadow_lookups += local[t].shadow_lookups;
+        counters->shadow_hits += local[t].shadow_hits;
+    }
+    return done == tiles;
+}
+
+void Tinyraytracer::render_tiles(unsigned char *pixmap, std::atomic<size_t> *next, std::atomic<size_t> *done,
+                                 const CancelToken *cancel, RayCounters *counters) const
+{
+    const size_t tiles_x = (width + TILE_SIZE - 1) / TILE_SIZE;
+    const size_t tiles = tiles_x * ((height + TILE_SIZE - 1) / TILE_SIZE);
+    for (size_t t = (*next)++; t < tiles && !cancel->cancelled(); t = (*next)++)
+    {
+        size_t x = t % tiles_x * TILE_SIZE, y = t / tiles_x * TILE_SIZE;
+        (this->*(wavefront ? kernels->render_wavefront : kernels->render_tile))(
+            pixmap, x, y, std::min<size_t>(x + TILE_SIZE, width), std::min<size_t>(y + TILE_SIZE, height), counters);
+        (*done)++;
+    }
+}
+
+template <unsigned Features, unsigned MaxDepth>
+KERNEL_CLONES
+void Tinyraytracer::render_tile(unsigned char *pixmap, size_t x0, size_t y0, size_t x1, size_t y1,
+                                RayCounters *counters) const
+{
+    TRACE_SCOPE("tile");
+    for (size_t j = y0; j < y1; j++)
     { // actual rendering loop
+        for (size_t i = x0; i < x1; i++)
+            store_pixel(&pixmap[(j * width + i) * 4],
+                        cast_ray<Features, MaxDepth>(Vec3f(0, 0, 0), primary_ray(i + 0.5, j + 0.5), 0, counters));
+    }
+}
+
+KERNEL_CLONES
+Vec3f Tinyraytracer::envmap_lookup(const Vec3f &dir) const
+{
+    double phi = fast_math ? fast_atan2(dir.z, dir.x) : atan2(dir.z, dir.x);
+    double theta = fast_math ? fast_acos(dir.y) : acos(dir.y);
+    int a = std::max(0, std::min(envmap_width - 1, static_cast<int>((phi / (2 * M_PI) + .5) * envmap_width)));
+    int b = std::max(0, std::min(envmap_height - 1, static_cast<int>(theta / M_PI * envmap_height)));
+    return envmap[a + b * envmap_width];
+    //        return Vec3f(0.2, 0.7, 0.8); // background color
+}
+
+void Tinyraytracer::render_costs(unsigned char *pixmap, CostMap &costs,
+                                 float anglev, float angleh, float anglel, float z_red, float size_mirror)
+{
+    setup_frame(anglev, angleh, anglel, z_red, size_mirror);
+    costs.resize(width, height);
+
+    for (size_t j = 0; j < height; j++)
+        for (size_t i = 0; i < width; i++)
+        {
+            RayCounters counters;
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            store_pixel(&pixmap[(j * width + i) * 4], cast_ray(Vec3f(0, 0, 0), primary_ray(i + 0.5, j + 0.5), 0, &counters));
+            std::chrono::duration<float, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+            costs.rays[j * width + i] = counters.rays;
+            costs.tests[j * width + i] = counters.tests;
+            costs.ns[j * width + i] = elapsed.count();
+        }
+}
+
+// radical inverse in the given base, the sub-pixel offsets of the anti-aliasing passes
+static float halton(unsigned index, unsigned base)
+{
+    float f = 1, r = 0;
+    for (; index > 0; index /= base)
+    {
+        f /= base;
+        r += f * (index % base);
+    }
+    return r;
+}
+
+// Pass 0 traces every 4th pixel of every 4th row, pass 1 the remaining pixels of
+// the 2x2 grid and pass 2 the rest, so that the picture gets sharper without
+// tracing any pixel twice. Untraced pixels copy the closest traced one.
+// The next passes each add one jittered sample per pixel to accum.
+bool Tinyraytracer::render_pass(unsigned char *pixmap, std::vector<Vec3f> &accum, unsigned pass, const CancelToken &cancel,
+                                float anglev, float angleh, float anglel, float z_red, float size_mirror)
+{
+    setup_frame(anglev, angleh, anglel, z_red, size_mirror);
+    accum.resize(width * height);
+    const unsigned stride = pass == 0 ? 4 : (pass == 1 ? 2 : 1);
+    const float dx = pass < 3 ? 0.5 : halton(pass - 2, 2);
+    const float dy = pass < 3 ? 0.5 : halton(pass - 2, 3);
+
+#pragma omp parallel for schedule(dynamic)
+    for (size_t j = 0; j < height; j += stride)
+    {
+        if (cancel.cancelled())
+            continue;
+        for (size_t i = 0; i < width; i += stride)
+        {
+            // pixels on the coarser grid were traced by the previous structural pass
+            if (pass > 0 && pass < 3 && i % (2 * stride) == 0 && j % (2 * stride) == 0)
+                continue;
+            Vec3f f = cast_ray(Vec3f(0, 0, 0), primary_ray(i + dx, j + dy));
+            accum[j * width + i] = pass < 3 ? f : accum[j * width + i] + f;
+        }
+    }
+    if (cancel.cancelled())
+        return false;
+
+    TRACE_SCOPE("encode");
+    const unsigned mask = ~(stride - 1);
+    const float weight = pass < 3 ? 1. : 1. / (pass - 1);
+#pragma omp parallel for
+    for (size_t j = 0; j < height; j++)
         for (size_t i = 0; i < width; i++)
+            store_pixel(&pixmap[(j * width + i) * 4], accum[(j & mask) * width + (i & mask)] * weight);
+    return true;
+}
+
+void Tinyraytracer::setup_frame(float anglev, float angleh, float anglel, float z_red, float size_mirror)
+{
+    if (lights_changed)
+    {
+        light_tree.build(lights);
+        lights_changed = false;
+    }
+    this->update_z_red(z_red);
+    this->update_size_mirror(size_mirror);
+    this->update_logo(anglel);
+    primitives.update();
+    quads.update();
+    // the engines splitting frames have the cores to themselves, the others keep them busy already
+    unsigned split = engine == ENGINE_OMP || engine == ENGINE_TILES ? threads : 1;
+    if (!particles.empty())
+        update_particles(anglel, split);
+    if (grid)
+    {
+        const int n = spheres.size();
+        sphere_grid.spheres.resize(n);
+#pragma omp parallel for num_threads(split)
+        for (int i = 0; i < n; i++)
         {
-            Vec3f v_0 = ex * ((i + 0.5) - width / 2.) + ey * (-(j + 0.5) + height / 2.) + ez * (height / (-2. * tan(fov / 2.)));
-            Vec3f f = cast_ray(Vec3f(0, 0, 0), v_0.normalize(), anglel);
-            float max = std::max(f[0], std::max(f[1], f[2]));
-            if (max > 1)
-                f = f * (1. / max);
-            for (size_t k = 0; k < 3; k++)
-                pixmap[(j * width + i) * 4 + k] =
-                    (unsigned char)(255 * std::max(0.f, std::min(1.f, f[k])));
-            pixmap[(j * width + i) * 4 + 3] = 255;
+            const Sphere &s = spheres[i];
+            sphere_grid.spheres[i] = Vec4f(s.center.x, s.center.y, s.center.z, s.radius);
         }
+        sphere_grid.build(split);
     }
+    cam_ex = Vec3f(cos(angleh * M_PI / 180),
+                   0,
+                   -sin(angleh * M_PI / 180));
+    cam_ey = Vec3f(sin(anglev * M_PI / 180) * sin(angleh * M_PI / 180),
+                   cos(anglev * M_PI / 180),
+                   sin(anglev * M_PI / 180) * cos(angleh * M_PI / 180));
+    cam_ez = Vec3f(cos(anglev * M_PI / 180) * sin(angleh * M_PI / 180),
+                   -sin(anglev * M_PI / 180),
+                   cos(anglev * M_PI / 180) * cos(angleh * M_PI / 180));
+    const float fov = M_PI / 3.;
+    cam_focal = height / (-2. * tan(fov / 2.));
+}
 
-    sf::Image result;
-    result.create(width, height, pixmap.data());
-    return result;
+// direction of the camera ray through the point (x, y) of the image, in pixels
+Vec3f Tinyraytracer::primary_ray(double x, double y) const
+{
+    Vec3f v_0 = cam_ex * (x - width / 2.) + cam_ey * (-y + height / 2.) + cam_ez * cam_focal;
+    return v_0.normalize();
+}
+
+KERNEL_CLONES
+void Tinyraytracer::store_pixel(unsigned char *pixel, Vec3f f)
+{
+    float max = std::max(f[0], std::max(f[1], f[2]));
+    if (max > 1)
+        f = f * (1. / max);
+    for (size_t k = 0; k < 3; k++)
+        pixel[k] = (unsigned char)(255 * std::max(0.f, std::min(1.f, f[k])));
+    pixel[3] = 255;
 }
 
 void Tinyraytracer::update_z_red(float z_red)
@@ -222,6 +615,27 @@ void Tinyraytracer::update_z_red(float z_red)
     // std::cout << "z_red: " << this->spheres[1].center[2]<<std::endl;
 }
 
+void Tinyraytracer::update_logo(float anglel)
+{
+    quads.orient(logo, Vec3f(cos(anglel * M_PI / 180), 0., sin(anglel * M_PI / 180)),
+                 Vec3f(cos((anglel - 90) * M_PI / 180), 0., sin((anglel - 90) * M_PI / 180)));
+}
+
+void Tinyraytracer::update_particles(float anglel, unsigned split)
+{
+    const int n = particles.size();
+#pragma omp parallel for num_threads(split)
+    for (int i = 0; i < n; i++)
+    {
+        const Particle &p = particles[i];
+        // a whole number of turns per turn of the logo, so that nothing jumps when anglel wraps around
+        int turns = 1 + int(8 / (1 + sqrtf(p.offset.x * p.offset.x + p.offset.z * p.offset.z)));
+        float a = anglel * M_PI / 180 * turns, c = cos(a), s = sin(a);
+        spheres[p.sphere].center = p.pivot + Vec3f(c * p.offset.x - s * p.offset.z, p.offset.y,
+                                                   s * p.offset.x + c * p.offset.z);
+    }
+}
+
 void Tinyraytracer::update_size_mirror(float size_mirror)
 {
     this->spheres[2].radius = size_mirror;
@@ -1,16 +1,32 @@
 #ifndef _TINYRAYTRACER_HH
 #define _TINYRAYTRACER_HH
 
+#include <atomic>
+#include <memory>
+#include <algorithm>
 #include <SFML/Graphics.hpp>
 
 #include "geometry.hh"
+#include "heatmap.hh"
+#include "model.hh"
+#include "fastmath.hh"
+#include "lights.hh"
+#include "primitives.hh"
+#include "quads.hh"
+#include "grid.hh"
+#include "workers.hh"
 
-struct Light {
-  Vec3f position;
-  float intensity;
-  Light(const Vec3f &p, const float i) :
-    position(p), intensity(i) { };
-};
+inline Vec3f reflect(const Vec3f &I, const Vec3f &N) {
+  return I - N*2.f*(I*N);
+}
+
+inline Vec3f refract(const Vec3f &I, const Vec3f &N, const float eta_t, const float eta_i=1.f) { // Snell's law
+  float cosi = - std::max(-1.f, std::min(1.f, I*N));
+  if (cosi<0) return refract(I, -N, eta_i, eta_t); // if the ray comes from the inside the object, swap the air and the media
+  float eta = eta_i / eta_t;
+  float k = 1 - eta*eta*(1 - cosi*cosi);
+  return k<0 ? Vec3f(1,0,0) : I*eta + N*(eta*cosi - sqrtf(k)); // k<0 = total reflection, no ray to refract. I refract it anyways, this has no physical meaning
+}
 
 struct Material {
   float refractive_index;
@@ -44,32 +60,217 @@ struct Sphere {
   }
 };
 
+// sphere swirling around a vertical axis through pivot as the logo turns, the
+// closer to the axis the faster
+struct Particle {
+  unsigned sphere;
+  Vec3f pivot, offset; // the sphere center is pivot + offset at angle 0
+};
+
+struct Mesh {
+  std::shared_ptr<const Model> model; // shared by the copies of the scene every worker gets
+  Material material;
+  Mesh(const std::shared_ptr<const Model> &m, const Material &mat) : model(m), material(mat) {}
+};
+
+// Scene object a ray hit, remembered by the shadow occluder cache
+struct ObjectRef {
+  enum Kind { NONE, SPHERE, PRIMITIVE, QUAD, MESH } kind;
+  unsigned index, face; // of the sphere, primitive id, quad or mesh, of the mesh triangle
+  ObjectRef() : kind(NONE), index(0), face(0) {};
+  ObjectRef(Kind k, unsigned i = 0, unsigned f = 0) : kind(k), index(i), face(f) {};
+};
+
+// Optional scene contents. The render kernels are instantiated for every
+// combination, so that absent features cost nothing, and picked at run time.
+enum SceneFeature {
+  FEATURE_PRIMITIVES = 1, // boxes, bounded planes, discs and cylinders, the checkerboard among them
+  FEATURE_MESH = 2,  // triangle meshes
+  FEATURE_MASKS = 4
+};
+// recursion depth the kernels are instantiated for, the first one is the default
+#define KERNEL_DEPTHS 4, 1, 2, 8
+
+// pixels of the logo per world unit
+#define LOGO_DPI 100
+
+// 3 passes bring the picture to one sample per pixel, the others add anti-aliasing samples
+#define PROGRESSIVE_PASSES 19
+// frames are rendered by square tiles, the granularity at which a render can be cancelled
+#define TILE_SIZE 32
+
+// Lets a long render notice it has been superseded: it is cancelled as soon as
+// the shared counter moved away from the generation the render was started for,
+// unless the spared frame is set to the frame it renders before the counter moves.
+struct CancelToken {
+  const std::atomic<unsigned long long> *current;
+  unsigned long long generation;
+  const std::atomic<unsigned long long> *spared;
+  unsigned long long frame;
+  CancelToken() : current(nullptr), generation(0), spared(nullptr), frame(0) {};
+  CancelToken(const std::atomic<unsigned long long> &c, unsigned long long g)
+      : current(&c), generation(g), spared(nullptr), frame(0) {};
+  CancelToken(const std::atomic<unsigned long long> &c, unsigned long long g, const std::atomic<unsigned long long> &s,
+              unsigned long long f)
+      : current(&c), generation(g), spared(&s), frame(f) {};
+  bool cancelled() const {
+    return current && current->load(std::memory_order_acquire) != generation &&
+           !(spared && spared->load(std::memory_order_relaxed) == frame);
+  };
+};
+
+// How the cores share the rendering work
+enum Engine {
+  ENGINE_SEQ,           // every frame on the calling thread
+  ENGINE_OMP,           // the tiles of a frame spread by OpenMP
+  ENGINE_FRAME_THREADS, // whole frames, one per std::thread worker (the workers are the caller's)
+  ENGINE_TILES          // the tiles of a frame pulled by std::thread workers kept between frames
+};
+// "seq", "omp", "frame-threads" or "tiles"
+bool parse_engine(const char *name, Engine &engine);
+const char *engine_name(Engine engine);
+
 class Tinyraytracer {
   unsigned width, height;
   int envmap_width, envmap_height;
   std::vector<Vec3f> envmap;
-  int logo_width, logo_height;
-  std::vector<Vec4f> logo;
-  float logo_fwidth, logo_fheight;
-  Vec3f logo_N;
-  Vec3f logo_H;
-  Vec3f logo_V;
-  Vec3f logo_pos;
-  Material logo_material;  
+  Quads quads;
+  std::vector<Material> quad_materials; // indexed by the quads
+  unsigned logo; // the quad showing the logo
   std::vector<Sphere> spheres;
+  std::vector<Particle> particles;
+  SphereGrid sphere_grid;
+  bool grid; // spheres found through sphere_grid, rebuilt every frame, rather than tested one by one
   std::vector<Light> lights;
+  LightTree light_tree;
+  bool lights_changed; // the tree is rebuilt by the next setup_frame
+  unsigned light_samples; // lights drawn at random per shading point, 0 for all of them
+  std::vector<Mesh> meshes;
+  Primitives primitives;
+  std::vector<Material> primitive_materials; // indexed by the primitives
+  Vec3f cam_ex, cam_ey, cam_ez;
+  double cam_focal; // image plane distance, in pixels
+  Engine engine;
+  unsigned threads; // used by the engines splitting a frame
+  WorkerPool workers; // of ENGINE_TILES, kept between frames
+  bool fast_math;   // approximated pow, rsqrt and envmap trigonometry, see fastmath.hh
+  unsigned max_depth;
+  bool wavefront; // tiles rendered stage by stage, see wavefront.cc
+  bool shadow_cache;
+
+  // render kernels specialized for one feature mask and maximum depth
+  struct Kernels {
+    Vec3f (Tinyraytracer::*cast_ray)(const Vec3f &orig, const Vec3f &dir, size_t depth, RayCounters *counters) const;
+    void (Tinyraytracer::*render_tile)(unsigned char *pixmap, size_t x0, size_t y0, size_t x1, size_t y1,
+                                       RayCounters *counters) const;
+    void (Tinyraytracer::*render_wavefront)(unsigned char *pixmap, size_t x0, size_t y0, size_t x1, size_t y1,
+                                            RayCounters *counters) const;
+  };
+  static const Kernels kernel_table[][FEATURE_MASKS];
+  const Kernels *kernels; // matching the current scene
+  void select_kernels();
 
 public:
   Tinyraytracer(unsigned w, unsigned h, sf::Image env_img, sf::Image logo_img, Vec3f apos);
   void add_sphere(Sphere s) { spheres.push_back(s); };
-  void add_light(Light l) { lights.push_back(l); };
+  void add_particle(Sphere s, const Vec3f &pivot);
+  // worth it from about a hundred spheres
+  void set_sphere_grid(bool g) { grid = g; };
+  // texture 0 is the logo given to the constructor
+  unsigned add_texture(const sf::Image &img);
+  // textured quad, its picture laid along horizontal and upright along cross(horizontal, normal).
+  // The texels give the diffuse color, and their alpha the share of light not refracted.
+  unsigned add_quad(const Vec3f &center, const Vec3f &normal, const Vec3f &horizontal, float width, float height,
+                    unsigned texture, const Material &m);
+  void add_light(Light l) { lights.push_back(l); lights_changed = true; };
+  void set_light_samples(unsigned n) { light_samples = n; };
+  void add_box(const Vec3f &min, const Vec3f &max, const Material &m);
+  // the parallelogram origin + a.u + b.v for a and b in [0, 1], lit on the side of u x v. With
+  // checker > 0, squares of that size alternate between m and odd.
+  void add_plane(const Vec3f &origin, const Vec3f &u, const Vec3f &v, const Material &m,
+                 float checker = 0, const Material &odd = Material());
+  void add_disc(const Vec3f &center, const Vec3f &normal, float radius, const Material &m);
+  void add_cylinder(const Vec3f &base, const Vec3f &axis, float radius, const Material &m);
+  // checkerboard of 20x20 in the plane y = -4
+  void add_board();
+  void add_mesh(const Mesh &m) { meshes.push_back(m); select_kernels(); };
+  // false, leaving the depth unchanged, if no kernel was instantiated for it
+  bool set_max_depth(unsigned depth);
+  unsigned features() const { return (primitives.empty() ? 0 : FEATURE_PRIMITIVES) | (meshes.empty() ? 0 : FEATURE_MESH); };
   sf::Image render(float anglev, float angleh, float anglel, float z_red, float size_mirror);
+  // returns false, leaving pixmap partly rendered, when cancelled
+  bool render(unsigned char *pixmap, float anglev, float angleh, float anglel, float z_red, float size_mirror,
+              const CancelToken &cancel = CancelToken(), RayCounters *counters = nullptr);
+  unsigned get_width() const { return width; };
+  unsigned get_height() const { return height; };
+  void set_size(unsigned w, unsigned h) { width = w; height = h; };
+  void set_engine(Engine e, unsigned t) { engine = e; threads = std::max(1u, t); };
+  Engine get_engine() const { return engine; };
+  void set_fast_math(bool f) { fast_math = f; };
+  bool get_fast_math() const { return fast_math; };
+  void set_wavefront(bool w) { wavefront = w; };
+  bool get_wavefront() const { return wavefront; };
+  void set_shadow_cache(bool c) { shadow_cache = c; };
+  // renders one refinement pass of a progressive frame, accum keeps the samples
+  // between passes; returns false when cancelled before the pass completed
+  bool render_pass(unsigned char *pixmap, std::vector<Vec3f> &accum, unsigned pass, const CancelToken &cancel,
+                   float anglev, float angleh, float anglel, float z_red, float size_mirror);
+  // renders the frame while recording how many rays, intersection tests and
+  // nanoseconds every pixel cost
+  void render_costs(unsigned char *pixmap, CostMap &costs,
+                    float anglev, float angleh, float anglel, float z_red, float size_mirror);
 private:
-  bool scene_intersect(const Vec3f &orig, const Vec3f &dir, Vec3f &hit, Vec3f &N, float anglel,
-		       Material &material);
-  Vec3f cast_ray(const Vec3f &orig, const Vec3f &dir, float anglel, size_t depth);
+  friend struct Bench; // times the building blocks of cast_ray in isolation
+  template <unsigned Features>
+  bool scene_intersect(const Vec3f &orig, const Vec3f &dir, Vec3f &hit, Vec3f &N, Material &material,
+                       RayCounters *counters, ObjectRef *object = nullptr) const;
+  // whether the shadow ray towards light number l is blocked before distance. The object that
+  // last blocked a ray towards that light on this thread is tested first: neighbouring
+  // pixels are usually shadowed by the same one.
+  template <unsigned Features>
+  bool occluded(size_t l, const Vec3f &orig, const Vec3f &dir, float distance, RayCounters *counters) const;
+  template <unsigned Features>
+  bool object_occludes(const ObjectRef &object, const Vec3f &orig, const Vec3f &dir, float distance) const;
+  Vec3f envmap_lookup(const Vec3f &dir) const;
+  // lights shading point, see LightTree and select_lights
+  void gather_lights(const Vec3f &point, std::vector<LightSample> &out) const;
+  // unit direction and distance from point to light l
+  void light_direction(const Light &l, const Vec3f &point, Vec3f &dir, float &distance) const {
+    if (fast_math) {
+      Vec3f v = l.position - point;
+      float d2 = v*v, r = fast_rsqrt(d2);
+      dir = v*r;
+      distance = d2*r;
+    } else {
+      dir = (l.position - point).normalize();
+      distance = (l.position - point).norm();
+    }
+  };
+  // v scaled to unit length, with the reciprocal square root estimate in fast-math mode
+  Vec3f unit(Vec3f v) const { return fast_math ? v * fast_rsqrt(v * v) : v.normalize(); };
+  // specular highlight for the cosine c between the reflected light and the view direction
+  float specular(float c, float exponent) const { return fast_math ? fast_pow(c, exponent) : powf(c, exponent); };
+  template <unsigned Features, unsigned MaxDepth>
+  Vec3f cast_ray(const Vec3f &orig, const Vec3f &dir, size_t depth, RayCounters *counters) const;
+  Vec3f cast_ray(const Vec3f &orig, const Vec3f &dir, size_t depth = 0, RayCounters *counters = nullptr) const {
+    return (this->*kernels->cast_ray)(orig, dir, depth, counters);
+  };
+  void setup_frame(float anglev, float angleh, float anglel, float z_red, float size_mirror);
+  template <unsigned Features, unsigned MaxDepth>
+  void render_tile(unsigned char *pixmap, size_t x0, size_t y0, size_t x1, size_t y1,
+                   RayCounters *counters) const;
+  template <unsigned Features, unsigned MaxDepth>
+  void render_wavefront(unsigned char *pixmap, size_t x0, size_t y0, size_t x1, size_t y1,
+                        RayCounters *counters) const;
+  // renders tiles taken from next until none is left, counting the completed ones in done
+  void render_tiles(unsigned char *pixmap, std::atomic<size_t> *next, std::atomic<size_t> *done,
+                    const CancelToken *cancel, RayCounters *counters) const;
+  Vec3f primary_ray(double x, double y) const;
+  static void store_pixel(unsigned char *pixel, Vec3f f);
   void update_size_mirror(float size_mirror);
   void update_z_red(float z_red);
+  void update_logo(float anglel);
+  void update_particles(float anglel, unsigned split);
 };
 
 #endif
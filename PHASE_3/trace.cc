@@ -0,0 +1,79 @@
+#include <mutex>
+#include <memory>
+#include <fstream>
+#include <iomanip>
+
+#include "trace.hh"
+
+// reserved per thread up front, so that recording rarely reallocates
+#define TRACE_RESERVE (1 << 16)
+
+namespace trace {
+  std::atomic<bool> enabled(false);
+
+  static std::chrono::steady_clock::time_point origin;
+  static std::mutex registry_mx; // only taken when a thread records its first span
+  static std::vector<std::unique_ptr<TraceBuffer> > registry;
+  static thread_local TraceBuffer *local = nullptr;
+
+  void start()
+  {
+      origin = std::chrono::steady_clock::now();
+      enabled = true;
+  }
+
+  unsigned long long now()
+  {
+      return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - origin).count();
+  }
+
+  TraceBuffer &buffer()
+  {
+      if (!local)
+      {
+          std::lock_guard<std::mutex> lock(registry_mx);
+          registry.push_back(std::unique_ptr<TraceBuffer>(new TraceBuffer()));
+          local = registry.back().get();
+          local->tid = registry.size();
+          local->thread_name = nullptr;
+          local->events.reserve(TRACE_RESERVE);
+      }
+      return *local;
+  }
+
+  void name_thread(const char *name)
+  {
+      if (enabled)
+          buffer().thread_name = name;
+  }
+
+  bool write(const char *path)
+  {
+      std::ofstream out(path);
+      if (!out)
+          return false;
+      std::lock_guard<std::mutex> lock(registry_mx);
+      out << std::fixed << std::setprecision(3);
+      out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[" << std::endl;
+      bool first = true;
+      for (size_t b = 0; b < registry.size(); b++)
+      {
+          const TraceBuffer &buf = *registry[b];
+          if (buf.thread_name)
+          {
+              out << (first ? "" : ",\n") << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << buf.tid
+                  << ",\"args\":{\"name\":\"" << buf.thread_name << "\"}}";
+              first = false;
+          }
+          for (size_t i = 0; i < buf.events.size(); i++)
+          {
+              const TraceEvent &e = buf.events[i];
+              out << (first ? "" : ",\n") << "{\"name\":\"" << e.name << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << buf.tid
+                  << ",\"ts\":" << e.begin * 1e-3 << ",\"dur\":" << (e.end - e.begin) * 1e-3 << "}";
+              first = false;
+          }
+      }
+      out << "]}" << std::endl;
+      return true;
+  }
+}
@@ -0,0 +1,51 @@
+#ifndef _TRACE_HH
+#define _TRACE_HH
+
+#include <atomic>
+#include <vector>
+#include <chrono>
+
+// One span of work on one thread, in nanoseconds since the trace started
+struct TraceEvent {
+  const char *name; // string literal, never copied
+  unsigned long long begin, end;
+};
+
+// Spans recorded by one thread. Only its thread appends to it, so no lock is
+// taken on the recording path; buffers are read once every thread is joined or parked.
+struct TraceBuffer {
+  unsigned tid;
+  const char *thread_name;
+  std::vector<TraceEvent> events;
+};
+
+namespace trace {
+  extern std::atomic<bool> enabled;
+  void start();
+  unsigned long long now(); // ns since start()
+  TraceBuffer &buffer();    // the calling thread's buffer, created on first use
+  void name_thread(const char *name);
+  // writes every recorded span as Chrome trace-event JSON (chrome://tracing, Perfetto)
+  bool write(const char *path);
+}
+
+// Records the span between its construction and destruction when tracing is on
+class TraceScope {
+  const char *name;
+  unsigned long long begin;
+
+public:
+  TraceScope(const char *name) : name(name), begin(trace::enabled.load(std::memory_order_relaxed) ? trace::now() : 0) {};
+  ~TraceScope() {
+    if (trace::enabled.load(std::memory_order_relaxed)) {
+      TraceEvent e = {name, begin, trace::now()};
+      trace::buffer().events.push_back(e);
+    }
+  };
+};
+
+#define TRACE_CONCAT2(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT2(a, b)
+#define TRACE_SCOPE(name) TraceScope TRACE_CONCAT(trace_scope_, __LINE__)(name)
+
+#endif
@@ -0,0 +1,336 @@
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <fstream>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "treelets.hh"
+
+static const char MAGIC[8] = {'T', 'R', 'E', 'E', 'L', 'E', 'T', '1'};
+
+std::ostream &operator<<(std::ostream &out, const TreeletStats &stats)
+{
+    const double mb = 1 << 20;
+    return out << stats.treelets << " treelets, " << stats.file_bytes / mb << " MB mapped, budget "
+               << stats.budget / mb << " MB, " << stats.visits << " visits, " << stats.faults << " page-ins, "
+               << stats.evictions << " evictions, " << stats.resident / mb << " MB resident (" << stats.peak / mb
+               << " MB at most)";
+}
+
+template <typename T> static void write_array(std::ofstream &out, const std::vector<T> &v)
+{
+    out.write((const char *)v.data(), v.size() * sizeof(T));
+}
+
+bool TreeletMesh::write(const char *path, const CompressedMesh &mesh)
+{
+    typedef CompressedMesh::Node Node;
+    typedef CompressedMesh::Leaf Leaf;
+    typedef CompressedMesh::Position Position;
+    if (mesh.empty())
+        return false;
+    const std::vector<Node> &nodes = mesh.nodes;
+    const std::vector<Leaf> &leaves = mesh.leaves;
+
+    // bytes under every node, whose children come after it
+    auto leaf_bytes = [&](unsigned l) {
+        return sizeof(Leaf) + (leaves[l + 1].vertex - leaves[l].vertex) * sizeof(Position) +
+               3 * (leaves[l + 1].triangle - leaves[l].triangle);
+    };
+    std::vector<size_t> size(nodes.size());
+    for (size_t n = nodes.size(); n--;)
+    {
+        size[n] = sizeof(Node);
+        for (size_t c = 0; c < CMESH_WIDTH; c++)
+        {
+            unsigned child = nodes[n].child[c];
+            if (child != ~0u)
+                size[n] += child & CMESH_LEAF ? leaf_bytes(child & ~CMESH_LEAF) : size[child];
+        }
+    }
+    auto fits = [&](unsigned ref) { return (ref & CMESH_LEAF) || size[ref] + sizeof(Leaf) <= TREELET_BYTES; };
+
+    // the top tree keeps the nodes too large for a treelet
+    std::vector<Node> top;
+    std::vector<unsigned> roots;
+    if (fits(0))
+    {
+        // one child covering the whole box
+        Node node = nodes[0];
+        for (size_t c = 0; c < CMESH_WIDTH; c++)
+        {
+            node.child[c] = c ? ~0u : CMESH_LEAF;
+            for (size_t k = 0; k < 3; k++)
+            {
+                node.lo[k][c] = 0;
+                node.hi[k][c] = c ? 0 : 255;
+            }
+        }
+        top.push_back(node);
+        roots.push_back(0);
+    }
+    else
+    {
+        std::vector<std::pair<unsigned, unsigned>> todo(1, std::make_pair(0u, 0u)); // top node to fill, from node
+        top.resize(1);
+        while (!todo.empty())
+        {
+            unsigned t = todo.back().first;
+            Node node = nodes[todo.back().second];
+            todo.pop_back();
+            for (size_t c = 0; c < CMESH_WIDTH; c++)
+            {
+                unsigned child = node.child[c];
+                if (child == ~0u)
+                    continue;
+                if (fits(child))
+                {
+                    node.child[c] = roots.size() | CMESH_LEAF;
+                    roots.push_back(child);
+                }
+                else
+                {
+                    node.child[c] = top.size();
+                    top.push_back(Node());
+                    todo.push_back(std::make_pair(node.child[c], child));
+                }
+            }
+            top[t] = node;
+        }
+    }
+
+    // written aside and renamed once complete, an interrupted run leaves no truncated file at path
+    const std::string temporary = std::string(path) + ".tmp";
+    std::ofstream out(temporary, std::ios::binary);
+    if (!out)
+        return false;
+    Header header = Header();
+    memcpy(header.magic, MAGIC, sizeof(MAGIC));
+    for (size_t k = 0; k < 3; k++)
+    {
+        header.origin[k] = mesh.origin[k];
+        header.scale[k] = mesh.scale[k];
+    }
+    header.top = top.size();
+    header.treelets = roots.size();
+    header.triangles = mesh.triangles();
+    std::vector<Treelet> treelets(roots.size());
+    size_t tables = sizeof(Header) + top.size() * sizeof(Node) + treelets.size() * sizeof(Treelet);
+    const size_t align = std::max<size_t>(TREELET_ALIGN, sysconf(_SC_PAGESIZE));
+    uint64_t offset = (tables + align - 1) / align * align;
+    std::vector<char> zeros(std::max<size_t>(offset, align));
+    out.write(zeros.data(), offset); // the tables, written once the treelets are
+
+    // every treelet numbers its nodes, leaves and vertices from 0, the faces go on from the treelets before
+    unsigned leaf_base = 0;
+    for (size_t i = 0; i < roots.size(); i++)
+    {
+        std::vector<Node> tn;
+        std::vector<Leaf> tl;
+        std::vector<Position> tp;
+        std::vector<uint8_t> ts;
+        auto add_leaf = [&](unsigned l) {
+            tl.push_back(Leaf{unsigned(tp.size()), unsigned(ts.size() / 3)});
+            tp.insert(tp.end(), mesh.positions.begin() + leaves[l].vertex, mesh.positions.begin() + leaves[l + 1].vertex);
+            ts.insert(ts.end(), mesh.strips.begin() + 3 * leaves[l].triangle,
+                      mesh.strips.begin() + 3 * leaves[l + 1].triangle);
+            return unsigned(tl.size() - 1) | CMESH_LEAF;
+        };
+        Treelet &treelet = treelets[i];
+        if (roots[i] & CMESH_LEAF)
+            treelet.root = add_leaf(roots[i] & ~CMESH_LEAF);
+        else
+        {
+            std::vector<std::pair<unsigned, unsigned>> todo(1, std::make_pair(0u, roots[i]));
+            tn.resize(1);
+            while (!todo.empty())
+            {
+                unsigned t = todo.back().first;
+                Node node = nodes[todo.back().second];
+                todo.pop_back();
+                for (size_t c = 0; c < CMESH_WIDTH; c++)
+                {
+                    unsigned child = node.child[c];
+                    if (child == ~0u)
+                        continue;
+                    if (child & CMESH_LEAF)
+                        node.child[c] = add_leaf(child & ~CMESH_LEAF);
+                    else
+                    {
+                        node.child[c] = tn.size();
+                        tn.push_back(Node());
+                        todo.push_back(std::make_pair(node.child[c], child));
+                    }
+                }
+                tn[t] = node;
+            }
+            treelet.root = 0;
+        }
+        tl.push_back(Leaf{unsigned(tp.size()), unsigned(ts.size() / 3)});
+
+        treelet.offset = offset;
+        treelet.nodes = tn.size();
+        treelet.leaves = tl.size();
+        treelet.positions = tp.size();
+        treelet.triangles = ts.size() / 3;
+        treelet.leaf_base = leaf_base;
+        treelet.bytes = tn.size() * sizeof(Node) + tl.size() * sizeof(Leaf) + tp.size() * sizeof(Position) + ts.size();
+        write_array(out, tn);
+        write_array(out, tl);
+        write_array(out, tp);
+        write_array(out, ts);
+        size_t padding = (align - treelet.bytes % align) % align;
+        out.write(zeros.data(), padding);
+        offset += treelet.bytes + padding;
+        leaf_base += tl.size() - 1;
+    }
+
+    out.seekp(0);
+    out.write((const char *)&header, sizeof(header));
+    write_array(out, top);
+    write_array(out, treelets);
+    out.close();
+    if (!out || rename(temporary.c_str(), path))
+    {
+        remove(temporary.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool TreeletMesh::open(const char *path, size_t budget)
+{
+    unmap();
+    int fd = ::open(path, O_RDONLY);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    void *p = MAP_FAILED;
+    if (!fstat(fd, &st) && size_t(st.st_size) >= sizeof(Header))
+        p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED)
+        return false;
+    map = (const char *)p;
+    map_bytes = st.st_size;
+    // the rays jump from treelet to treelet, reading ahead would page in treelets they never visit
+    madvise(p, map_bytes, MADV_RANDOM);
+
+    memcpy(&header, map, sizeof(Header));
+    const char *tables = map + sizeof(Header);
+    bool valid = !memcmp(header.magic, MAGIC, sizeof(MAGIC)) && header.top &&
+                 sizeof(Header) + header.top * sizeof(CompressedMesh::Node) + header.treelets * sizeof(Treelet) <= map_bytes;
+    if (valid)
+    {
+        const CompressedMesh::Node *nodes = (const CompressedMesh::Node *)tables;
+        top.assign(nodes, nodes + header.top);
+        const Treelet *first = (const Treelet *)(nodes + header.top);
+        treelets.assign(first, first + header.treelets);
+        for (const Treelet &treelet : treelets)
+            valid &= treelet.offset + treelet.bytes <= map_bytes;
+    }
+    if (!valid)
+    {
+        std::cerr << "Error: " << path << " holds no treelets" << std::endl;
+        unmap();
+        return false;
+    }
+
+    this->budget = budget;
+    last_use.reset(new std::atomic<unsigned long long>[treelets.size()]());
+    clock = visits = faults = evictions = resident = peak = 0;
+    return true;
+}
+
+void TreeletMesh::unmap()
+{
+    if (map)
+        munmap((void *)map, map_bytes);
+    map = nullptr;
+    map_bytes = 0;
+    header = Header();
+    top.clear();
+    treelets.clear();
+    last_use.reset();
+}
+
+void TreeletMesh::touch(unsigned t) const
+{
+    visits.fetch_add(1, std::memory_order_relaxed);
+    unsigned long long used = last_use[t].load(std::memory_order_relaxed);
+    while (used && !last_use[t].compare_exchange_weak(used, ++clock, std::memory_order_relaxed))
+        ;
+    if (used)
+        return;
+
+    // treelets come into and out of memory under the lock only
+    std::lock_guard<std::mutex> lock(mx);
+    if (last_use[t].exchange(++clock))
+        return;
+    faults++;
+    resident += treelets[t].bytes;
+    peak = std::max(size_t(peak), size_t(resident));
+    madvise((void *)(map + treelets[t].offset), treelets[t].bytes, MADV_WILLNEED);
+    if (resident <= budget)
+        return;
+
+    // the least recently used go until an eighth of the budget is free, so that evictions come in batches
+    std::vector<std::pair<unsigned long long, unsigned>> in_memory;
+    for (unsigned i = 0; i < treelets.size(); i++)
+    {
+        unsigned long long used_at = last_use[i].load();
+        if (used_at && i != t)
+            in_memory.push_back(std::make_pair(used_at, i));
+    }
+    std::sort(in_memory.begin(), in_memory.end());
+    for (size_t i = 0; i < in_memory.size() && resident > budget - budget / 8; i++)
+        // a treelet visited since is no longer the least recently used
+        if (last_use[in_memory[i].second].compare_exchange_strong(in_memory[i].first, 0))
+            evict(in_memory[i].second);
+}
+
+// the pages are read again from the file if a ray still walks the treelet. Only the pages
+// between the treelet and the next one go: in a file written with smaller pages than these,
+// the pages the treelet shares with its neighbours stay, since they are counted in memory.
+void TreeletMesh::evict(unsigned t) const
+{
+    static const size_t page = sysconf(_SC_PAGESIZE);
+    size_t end = t + 1 < treelets.size() ? treelets[t + 1].offset : map_bytes;
+    size_t first = (treelets[t].offset + page - 1) / page * page, last = end / page * page;
+    if (first < last)
+        madvise((void *)(map + first), last - first, MADV_DONTNEED);
+    resident -= treelets[t].bytes;
+    evictions++;
+}
+
+bool TreeletMesh::triangle(unsigned face, Vec3f &a, Vec3f &b, Vec3f &c) const
+{
+    unsigned leaf = face / CMESH_WIDTH;
+    // the last treelet starting at or before leaf
+    auto after = std::upper_bound(treelets.begin(), treelets.end(), leaf,
+                                  [](unsigned l, const Treelet &treelet) { return l < treelet.leaf_base; });
+    if (after == treelets.begin())
+        return false;
+    unsigned t = after - treelets.begin() - 1;
+    if (leaf - treelets[t].leaf_base + 1 >= treelets[t].leaves)
+        return false;
+    return tree(t).triangle(leaf - treelets[t].leaf_base, face % CMESH_WIDTH, a, b, c);
+}
+
+TreeletStats TreeletMesh::stats() const
+{
+    TreeletStats stats;
+    stats.treelets = treelets.size();
+    stats.file_bytes = map_bytes;
+    stats.budget = budget;
+    stats.visits = visits;
+    stats.faults = faults;
+    stats.evictions = evictions;
+    stats.resident = resident;
+    stats.peak = peak;
+    return stats;
+}
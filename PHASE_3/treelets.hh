@@ -0,0 +1,105 @@
+#ifndef _TREELETS_HH
+#define _TREELETS_HH
+
+#include <vector>
+#include <atomic>
+#include <mutex>
+#include <memory>
+#include <iostream>
+#include <cstdint>
+
+#include "cmesh.hh"
+
+// most bytes of a treelet, the subtrees paged in and out as a whole
+#define TREELET_BYTES (64 << 10)
+// treelets start at multiples of it in the file, or of the page size where pages are larger,
+// so that evicting a treelet drops no page of its neighbours
+#define TREELET_ALIGN 4096
+
+// how the treelets of a mesh were paged
+struct TreeletStats {
+  size_t treelets, file_bytes, budget;
+  size_t visits, faults, evictions; // faults are the visits that paged a treelet in
+  size_t resident, peak;            // bytes of the treelets in memory, now and at most
+};
+std::ostream &operator<<(std::ostream &out, const TreeletStats &stats);
+
+// A CompressedMesh cut into treelets, subtrees of at most TREELET_BYTES stored in a file
+// that is mapped rather than read. The top tree over the treelets stays in memory, the
+// treelets rays reach are paged in by the system, and the least recently used ones are
+// dropped once the treelets in memory exceed the budget. Dropped pages are read again
+// from the file, so a ray walking a treelet dropped under it merely pages it in again.
+class TreeletMesh {
+  struct Treelet {
+    uint64_t offset, bytes;                       // in the file
+    unsigned nodes, leaves, positions, triangles; // leaves counts the one past the last
+    unsigned root;                                // a node, or a leaf | CMESH_LEAF
+    unsigned leaf_base;                           // leaves of the treelets before
+  };
+  struct Header {
+    char magic[8];
+    float origin[3], scale[3];
+    unsigned top, treelets;
+    uint64_t triangles;
+  };
+  Header header;
+  std::vector<CompressedMesh::Node> top; // children are top nodes or treelet | CMESH_LEAF
+  std::vector<Treelet> treelets;
+  const char *map; // the whole file
+  size_t map_bytes, budget;
+
+  // residency, shared by the threads: when each treelet was last visited, 0 while out of memory
+  std::unique_ptr<std::atomic<unsigned long long>[]> last_use;
+  mutable std::atomic<unsigned long long> clock;
+  mutable std::atomic<size_t> visits, faults, evictions, resident, peak;
+  mutable std::mutex mx; // held to account a treelet in or out of memory
+
+  // marks treelet t used, accounting for it if it was out of memory
+  void touch(unsigned t) const;
+  void evict(unsigned t) const;
+  void unmap();
+  CompressedMesh::Tree tree(unsigned t) const {
+    const Treelet &treelet = treelets[t];
+    touch(t);
+    const char *p = map + treelet.offset;
+    const CompressedMesh::Node *nodes = (const CompressedMesh::Node *)p;
+    const CompressedMesh::Leaf *leaves = (const CompressedMesh::Leaf *)(nodes + treelet.nodes);
+    const CompressedMesh::Position *positions = (const CompressedMesh::Position *)(leaves + treelet.leaves);
+    const uint8_t *strips = (const uint8_t *)(positions + treelet.positions);
+    return CompressedMesh::Tree{nodes, leaves, positions, strips, header.origin, header.scale, treelet.leaf_base};
+  };
+
+public:
+  TreeletMesh()
+      : header(), map(nullptr), map_bytes(0), budget(0), clock(0), visits(0), faults(0), evictions(0), resident(0),
+        peak(0) {};
+  ~TreeletMesh() { unmap(); };
+  // cuts mesh into treelets stored in path, which is replaced only once they are all written
+  static bool write(const char *path, const CompressedMesh &mesh);
+  // maps the treelets of path, with budget bytes of them in memory
+  bool open(const char *path, size_t budget);
+  bool empty() const { return top.empty(); };
+  size_t triangles() const { return header.triangles; };
+  // the top tree and the treelets in memory
+  size_t bytes() const {
+    return top.size() * sizeof(CompressedMesh::Node) + treelets.size() * sizeof(Treelet) + resident;
+  };
+  TreeletStats stats() const;
+
+  // the corners of face, as traverse numbers the faces; false if there is no such face
+  bool triangle(unsigned face, Vec3f &a, Vec3f &b, Vec3f &c) const;
+
+  // calls test(face, a, b, c, dist) as CompressedMesh::traverse does, treelet after treelet
+  template <typename Test>
+  __attribute__((always_inline)) size_t traverse(const Vec3f &orig, const Vec3f &dir, float &dist, Test test) const {
+    size_t tests = 0;
+    if (top.empty())
+      return 0;
+    CompressedMesh::walk(top.data(), 0, orig, dir, dist, [&](unsigned t, float &d) {
+      tests += tree(t).traverse(treelets[t].root, orig, dir, d, test);
+    });
+    return tests;
+  }
+};
+
+#endif
@@ -0,0 +1,176 @@
+#include <cmath>
+#include <vector>
+#include <algorithm>
+
+#include "tinyraytracer.hh"
+#include "trace.hh"
+#include "dispatch.hh"
+
+// Wavefront rendering of a tile: instead of following every pixel's ray tree
+// depth first, all the rays of one bounce go through the same stage (intersect,
+// envmap for the misses, shade, shadow) before the next bounce starts. The
+// colour reaching a pixel is the sum of the contributions of its paths, each
+// weighted by the product of the albedos along the way.
+
+struct WaveRay
+{
+    Vec3f orig, dir;
+    float weight;
+    unsigned pixel; // in the tile
+    unsigned key;   // direction bin, for sorting
+};
+
+struct WaveHit
+{
+    Vec3f point, N, dir;
+    Material material;
+    float weight;
+    unsigned pixel;
+};
+
+struct ShadowRay
+{
+    Vec3f orig, dir;
+    Vec3f color; // added to the pixel if the light is visible
+    float distance;
+    unsigned pixel, light;
+};
+
+// per thread buffers, reused from tile to tile
+struct Wavefront
+{
+    std::vector<WaveRay> rays, next, misses;
+    std::vector<WaveHit> hits;
+    std::vector<ShadowRay> shadows;
+    std::vector<LightSample> samples;
+    std::vector<Vec3f> accum;
+};
+
+// octant, then 16x16 bins of the x and y components
+static unsigned direction_key(const Vec3f &dir)
+{
+    unsigned octant = (dir.x < 0) | (dir.y < 0) << 1 | (dir.z < 0) << 2;
+    unsigned bx = std::min(15, int((dir.x + 1) * 8)), by = std::min(15, int((dir.y + 1) * 8));
+    return octant << 8 | by << 4 | bx;
+}
+
+static WaveRay wave_ray(const Vec3f &orig, const Vec3f &dir, float weight, unsigned pixel)
+{
+    WaveRay r;
+    r.orig = orig;
+    r.dir = dir;
+    r.weight = weight;
+    r.pixel = pixel;
+    r.key = direction_key(dir);
+    return r;
+}
+
+template <unsigned Features, unsigned MaxDepth>
+KERNEL_CLONES
+void Tinyraytracer::render_wavefront(unsigned char *pixmap, size_t x0, size_t y0, size_t x1, size_t y1,
+                                     RayCounters *counters) const
+{
+    TRACE_SCOPE("tile");
+    static thread_local Wavefront wf;
+    const size_t w = x1 - x0;
+    wf.accum.assign(w * (y1 - y0), Vec3f(0, 0, 0));
+
+    // generate
+    wf.rays.clear();
+    for (size_t j = y0; j < y1; j++)
+        for (size_t i = x0; i < x1; i++)
+            wf.rays.push_back(wave_ray(Vec3f(0, 0, 0), primary_ray(i + 0.5, j + 0.5), 1.f, (j - y0) * w + i - x0));
+
+    for (size_t depth = 0; !wf.rays.empty(); depth++)
+    {
+        if (counters)
+            counters->rays += wf.rays.size();
+        if (depth > MaxDepth)
+        {
+            for (const auto &r : wf.rays)
+                wf.accum[r.pixel] = wf.accum[r.pixel] + envmap_lookup(r.dir) * r.weight;
+            break;
+        }
+
+        // rays going the same way tend to hit the same objects and envmap texels
+        if (depth > 0)
+            std::sort(wf.rays.begin(), wf.rays.end(), [](const WaveRay &a, const WaveRay &b) { return a.key < b.key; });
+
+        // intersect
+        wf.hits.clear();
+        wf.misses.clear();
+        for (const auto &r : wf.rays)
+        {
+            WaveHit h;
+            if (scene_intersect<Features>(r.orig, r.dir, h.point, h.N, h.material, counters))
+            {
+                h.dir = r.dir;
+                h.weight = r.weight;
+                h.pixel = r.pixel;
+                wf.hits.push_back(h);
+            }
+            else
+                wf.misses.push_back(r);
+        }
+
+        // envmap
+        for (const auto &r : wf.misses)
+            wf.accum[r.pixel] = wf.accum[r.pixel] + envmap_lookup(r.dir) * r.weight;
+
+        // shade: spawn the next bounce and the shadow rays, paths that no longer carry any weight are dropped
+        wf.next.clear();
+        wf.shadows.clear();
+        for (const auto &h : wf.hits)
+        {
+            const Vec3f &N = h.N, &point = h.point;
+            const Material &material = h.material;
+            if (h.weight * material.albedo[2] != 0)
+            {
+                Vec3f reflect_dir = unit(reflect(h.dir, N));
+                Vec3f reflect_orig = reflect_dir * N < 0 ? point - N * 1e-3 : point + N * 1e-3;
+                wf.next.push_back(wave_ray(reflect_orig, reflect_dir, h.weight * material.albedo[2], h.pixel));
+            }
+            if (h.weight * material.albedo[3] != 0)
+            {
+                Vec3f refract_dir = unit(refract(h.dir, N, material.refractive_index));
+                Vec3f refract_orig = refract_dir * N < 0 ? point - N * 1e-3 : point + N * 1e-3;
+                wf.next.push_back(wave_ray(refract_orig, refract_dir, h.weight * material.albedo[3], h.pixel));
+            }
+            gather_lights(point, wf.samples);
+            for (const auto &sample : wf.samples)
+            {
+                const size_t i = sample.light;
+                const float intensity = lights[i].intensity * sample.scale;
+                ShadowRay s;
+                light_direction(lights[i], point, s.dir, s.distance);
+                s.orig = s.dir * N < 0 ? point - N * 1e-3 : point + N * 1e-3;
+                float diffuse = intensity * std::max(0.f, s.dir * N);
+                float spec = specular(std::max(0.f, -reflect(-s.dir, N) * h.dir), material.specular_exponent) * intensity;
+                s.color = (material.diffuse_color * diffuse * material.albedo[0] + Vec3f(1., 1., 1.) * spec * material.albedo[1]) * h.weight;
+                s.pixel = h.pixel;
+                s.light = i;
+                wf.shadows.push_back(s);
+            }
+        }
+
+        // shadow
+        if (counters)
+            counters->rays += wf.shadows.size();
+        for (const auto &s : wf.shadows)
+            if (!occluded<Features>(s.light, s.orig, s.dir, s.distance, counters))
+                wf.accum[s.pixel] = wf.accum[s.pixel] + s.color;
+
+        std::swap(wf.rays, wf.next);
+    }
+
+    for (size_t p = 0; p < wf.accum.size(); p++)
+        store_pixel(&pixmap[((y0 + p / w) * width + x0 + p % w) * 4], wf.accum[p]);
+}
+
+#define INSTANTIATE(F, D) \
+    template void Tinyraytracer::render_wavefront<F, D>(unsigned char *, size_t, size_t, size_t, size_t, RayCounters *) const;
+#define INSTANTIATE_FOR_DEPTH(D) INSTANTIATE(0, D) INSTANTIATE(1, D) INSTANTIATE(2, D) INSTANTIATE(3, D)
+INSTANTIATE_FOR_DEPTH(4)
+INSTANTIATE_FOR_DEPTH(1)
+INSTANTIATE_FOR_DEPTH(2)
+INSTANTIATE_FOR_DEPTH(8)
@@ -0,0 +1,53 @@
+#include "workers.hh"
+#include "trace.hh"
+
+WorkerPool::~WorkerPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(mx);
+        stop = true;
+    }
+    wake.notify_all();
+    for (size_t t = 0; t < threads.size(); t++)
+        threads[t].join();
+}
+
+void WorkerPool::run(unsigned n, const std::function<void(unsigned)> &f)
+{
+    {
+        std::lock_guard<std::mutex> lock(mx);
+        // worker t runs job(t + 1), threads started now skip the rounds before this one
+        while (threads.size() + 1 < n)
+            threads.push_back(std::thread(&WorkerPool::work, this, unsigned(threads.size() + 1), round));
+        job = f;
+        active = n;
+        busy = n - 1;
+        round++;
+    }
+    wake.notify_all();
+    f(0);
+
+    std::unique_lock<std::mutex> lock(mx);
+    idle.wait(lock, [this] { return busy == 0; });
+    job = nullptr;
+}
+
+void WorkerPool::work(unsigned id, unsigned long long seen)
+{
+    trace::name_thread(name);
+    std::unique_lock<std::mutex> lock(mx);
+    while (true)
+    {
+        wake.wait(lock, [&] { return stop || round != seen; });
+        if (stop)
+            return;
+        seen = round;
+        if (id >= active)
+            continue;
+        lock.unlock();
+        job(id);
+        lock.lock();
+        if (--busy == 0)
+            idle.notify_one();
+    }
+}
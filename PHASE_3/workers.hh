@@ -0,0 +1,36 @@
+#ifndef _WORKERS_HH
+#define _WORKERS_HH
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+// Threads parked on a condition variable between the jobs they share, so that a job per
+// frame neither starts threads nor loses their thread_local caches and trace buffers.
+// A copy starts without threads: copies of a renderer may render at once and never
+// share their workers.
+class WorkerPool {
+  const char *name; // of the threads in traces
+  std::vector<std::thread> threads;
+  std::mutex mx;
+  std::condition_variable wake, idle;
+  std::function<void(unsigned)> job; // of the current round
+  unsigned long long round;           // bumped for every job
+  unsigned active, busy;              // workers taking part in the round, and still running it
+  bool stop;
+
+  void work(unsigned id, unsigned long long seen);
+
+public:
+  WorkerPool(const char *name) : name(name), round(0), active(0), busy(0), stop(false) {};
+  WorkerPool(const WorkerPool &other) : WorkerPool(other.name) {};
+  WorkerPool &operator=(const WorkerPool &) { return *this; };
+  ~WorkerPool();
+  // calls job(0) on the calling thread and job(1) .. job(n - 1) on the workers, started on
+  // first use, and returns once every call returned
+  void run(unsigned n, const std::function<void(unsigned)> &job);
+};
+
+#endif